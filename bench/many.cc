@@ -0,0 +1,97 @@
+/*
+ * Compares get_many() with one get_cstr() call per key when the keys
+ * are not in the processor caches.
+ *
+ * Usage: many [keys]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include "setting.h"
+
+using namespace dutil;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Evicts the setting from the caches by reading a larger buffer. */
+static size_t flush(std::vector<char> *junk)
+{
+    size_t sum = 0;
+    for (size_t i = 0; i < junk->size(); i += 64)
+        sum += ++(*junk)[i];
+    return sum;
+}
+
+template <class Storage, class ThreadPolicy>
+static void run(const char *name, size_t n)
+{
+    const size_t batch = 16, rounds = 200;
+    basic_setting<Storage, ThreadPolicy> cfg;
+    std::vector<std::vector<std::string> > batches(rounds);
+    std::vector<std::string> values;
+    std::vector<char> junk(64 << 20);
+    double one = 0, many = 0, t0;
+    size_t found = 0, sink = 0;
+    char buf[64];
+
+    for (size_t i = 0; i < n; i++) {
+        snprintf(buf, sizeof(buf), "section%lu.key%lu = value %lu",
+                 static_cast<unsigned long>(i % 97),
+                 static_cast<unsigned long>(i),
+                 static_cast<unsigned long>(i));
+        cfg << buf;
+    }
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t k = 0; k < batch; k++) {
+            size_t i = rand() % n;
+            snprintf(buf, sizeof(buf), "section%lu.key%lu",
+                     static_cast<unsigned long>(i % 97),
+                     static_cast<unsigned long>(i));
+            batches[r].push_back(buf);
+        }
+    }
+
+    for (size_t r = 0; r < rounds; r++) {
+        sink += flush(&junk);
+        t0 = now();
+        for (size_t k = 0; k < batch; k++)
+            found += cfg.get_cstr(batches[r][k]) != NULL;
+        one += now() - t0;
+
+        sink += flush(&junk);
+        t0 = now();
+        found += cfg.get_many(batches[r], &values);
+        many += now() - t0;
+    }
+    printf("%-18s %8lu keys  get_cstr %7.1f ns/key  get_many %7.1f ns/key"
+           "%s\n", name, static_cast<unsigned long>(n),
+           one * 1e9 / (rounds * batch), many * 1e9 / (rounds * batch),
+           (found == 2 * rounds * batch && sink) ? "" : " (missing keys)");
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1000000;
+
+    srand(1);
+    run<map_storage, single_threaded>("map_storage", n);
+    run<inline_storage, single_threaded>("inline_storage", n);
+    run<hash_storage, single_threaded>("hash_storage", n);
+    run<flat_storage, single_threaded>("flat_storage", n);
+    run<eytzinger_storage, single_threaded>("eytzinger_storage", n);
+    run<hamt_storage, single_threaded>("hamt_storage", n);
+    run<hash_storage, multi_threaded>("hash, locked", n);
+    return 0;
+}
+
+// vim: ts=4 sw=4 et ai cindent
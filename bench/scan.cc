@@ -0,0 +1,72 @@
+/*
+ * Measures the throughput of the streaming scanner against loading
+ * into a setting.
+ *
+ * Usage: scan [megabytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <string>
+
+#include "setting.h"
+
+using namespace dutil;
+
+struct sink {
+    size_t bytes;
+
+    void item(string_ref key, string_ref value, size_t)
+    {
+        bytes += key.size + value.size;
+    }
+};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t megabytes = (argc > 1) ? strtoul(argv[1], NULL, 10) : 256;
+    const char *path = "/tmp/setting-bench-scan.cfg";
+    FILE *fp = fopen(path, "wb");
+    char buf[128];
+    size_t written = 0;
+    sink s = { 0 };
+    double t0, t1, t2;
+
+    if (fp == NULL) {
+        perror(path);
+        return 1;
+    }
+    for (size_t i = 0; written < megabytes << 20; i++) {
+        int n = snprintf(buf, sizeof(buf),
+                         "  section%lu.key%lu =  value number %lu\n",
+                         static_cast<unsigned long>(i % 1000),
+                         static_cast<unsigned long>(i % 100000),
+                         static_cast<unsigned long>(i));
+        fwrite(buf, 1, n, fp);
+        written += n;
+    }
+    fclose(fp);
+
+    t0 = now();
+    scan_file(path, &s);
+    t1 = now();
+    {
+        setting cfg(path);
+    }
+    t2 = now();
+    printf("scan_file %8.1f MB/s\nsetting   %8.1f MB/s\n",
+           written / (t1 - t0) / 1e6, written / (t2 - t1) / 1e6);
+    remove(path);
+    return s.bytes > 0 ? 0 : 1;
+}
+
+// vim: ts=4 sw=4 et ai cindent
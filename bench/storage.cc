@@ -0,0 +1,95 @@
+/*
+ * Compares lookup speed and memory of the storage backends.
+ *
+ * Usage: storage [lookups]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include "setting.h"
+
+using namespace dutil;
+
+struct memory_sum {
+    memory_stats total;
+
+    void entry(string_ref, const memory_stats &m) { total += m; }
+    void shared(const memory_stats &m) { total += m; }
+};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+template <class Storage>
+static void run(const char *name, const std::vector<std::string> &keys,
+                const std::vector<size_t> &probes)
+{
+    Storage s;
+    string_ref v;
+    size_t found = 0;
+    memory_sum mem;
+    double t0, t1, t2;
+
+    t0 = now();
+    for (size_t i = 0; i < keys.size(); i++)
+        s.set(keys[i], keys[i]);
+    s.commit();
+    t1 = now();
+    for (size_t i = 0; i < probes.size(); i++)
+        if (s.find(keys[probes[i]], &v))
+            found += v.size;
+    t2 = now();
+    s.memory(&mem);
+
+    printf("%-18s %8lu keys  load %7.1f ns/key  find %7.1f ns  "
+           "%6.1f bytes/key%s\n", name,
+           static_cast<unsigned long>(keys.size()),
+           (t1 - t0) * 1e9 / keys.size(), (t2 - t1) * 1e9 / probes.size(),
+           static_cast<double>(mem.total.total()) / keys.size(),
+           found ? "" : " (nothing found)");
+}
+
+int main(int argc, char *argv[])
+{
+    size_t lookups = (argc > 1) ? strtoul(argv[1], NULL, 10) : 2000000;
+    size_t sizes[] = { 100, 10000, 1000000 };
+    char buf[64];
+
+    srand(1);
+    for (size_t n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+        std::vector<std::string> keys;
+        std::vector<size_t> probes;
+
+        for (size_t i = 0; i < sizes[n]; i++) {
+            snprintf(buf, sizeof(buf), "section%lu.key%d",
+                     static_cast<unsigned long>(i % 97), rand());
+            keys.push_back(buf);
+        }
+        for (size_t i = 0; i < lookups; i++)
+            probes.push_back(rand() % keys.size());
+
+        run<map_storage>("map_storage", keys, probes);
+        run<inline_storage>("inline_storage", keys, probes);
+        run<hash_storage>("hash_storage", keys, probes);
+        run<flat_storage>("flat_storage", keys, probes);
+        run<eytzinger_storage>("eytzinger_storage", keys, probes);
+        run<tree_storage>("tree_storage", keys, probes);
+        run<basic_flat_storage<false, true> >("flat, huge pages", keys,
+                                              probes);
+        run<basic_flat_storage<true, true> >("eytzinger, huge", keys,
+                                             probes);
+        printf("\n");
+    }
+    return 0;
+}
+
+// vim: ts=4 sw=4 et ai cindent
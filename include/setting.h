@@ -31,16 +31,34 @@
 #define SETTING_H_
 
 #include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef SETTING_HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #include <map>
 #include <string>
-#include <fstream>
 #include <cstdlib>
 #include <stdexcept>
 #include <vector>
 
+#ifndef BEGIN_SETTING_NAMESPACE
 #define BEGIN_SETTING_NAMESPACE namespace dutil {
 #define END_SETTING_NAMESPACE }
+#endif
+
+#include "setting_wire.h"
+#include "setting_storage.h"
+#include "setting_scan.h"
+#include "setting_thread.h"
+
+#ifndef SETTING_STORAGE
+#define SETTING_STORAGE map_storage
+#endif
 
 #ifndef DISALLOW_COPY_AND_ASSIGN
 #define DISALLOW_COPY_AND_ASSIGN(TypeName) \
@@ -74,6 +92,48 @@
  * core.id = HU7321
  * core.start = 12:30
  * @endcode
+ *
+ * A line "[section]" prefixes the keys that follow with "section.", up
+ * to the next section line; "[]" returns to unprefixed keys. The example
+ * above can be written as
+ *
+ * @code
+ * [core]
+ * alpha = 0.05
+ * beta = 0.2
+ * id = HU7321
+ * start = 12:30
+ * @endcode
+ *
+ * Values refer to other keys as $key, or as ${core.id} for keys with
+ * dots. \$ and \\ stand for a literal '$' and backslash; any other
+ * backslash is kept as written.
+ *
+ * A value in double quotes keeps its white-spaces and may hold the
+ * escapes \n, \t, \r, \" and \\, which are decoded when the file is
+ * read. A value in single quotes is taken literally, without escapes or
+ * references. Values without references or escapes are returned as
+ * they were read, without being parsed again on lookup.
+ *
+ * @code
+ * indent = "    "
+ * price = 'costs $5'
+ * greeting = "Hello,\t$name"
+ * @endcode
+ *
+ * A line ending with a backslash continues on the next one, without the
+ * next one's leading white-spaces. Values kept verbatim over several
+ * lines are written as here-documents:
+ *
+ * @code
+ * query = SELECT id, name \
+ *         FROM users
+ * cert = <<END
+ * -----BEGIN CERTIFICATE-----
+ * MIIBszCCAVmgAwIBAgIU...
+ * -----END CERTIFICATE-----
+ * END
+ * @endcode
  */
 
 
@@ -84,15 +144,128 @@ BEGIN_SETTING_NAMESPACE
  *  @{ The libsetting's API
  */
 
-/// Setting parser.
-class setting {
+/** Counters of the resolved-value cache, see basic_setting::set_cache_budget. */
+struct cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t bytes;           ///< Memory held by the cache.
+
+    cache_stats(): hits(0), misses(0), evictions(0), bytes(0) {}
+
+    /** Returns hits / (hits + misses), 0 if there were no lookups. */
+    double hit_rate() const
+    {
+        return (hits + misses > 0) ? double(hits) / (hits + misses) : 0.0;
+    }
+};
+
+/**
+ * Number of reads of each key, see basic_setting::set_profile.
+ *
+ * Profiles are saved as configuration text, one "key = reads" line per
+ * key, so a profile of a warmup run can be kept next to the
+ * configuration and loaded at startup.
+ */
+class access_profile {
+  public:
+    /** Counts one read of key. */
+    void hit(const std::string &key)
+    {
+        counts_[key]++;
+    }
+
+    /** Returns the number of reads of key. */
+    uint64_t count(const std::string &key) const
+    {
+        std::map<std::string, uint64_t>::const_iterator it = counts_.find(key);
+        return (it == counts_.end()) ? 0 : it->second;
+    }
+
+    /** Returns the number of keys read. */
+    size_t size() const
+    {
+        return counts_.size();
+    }
+
+    void clear()
+    {
+        counts_.clear();
+    }
+
+    /**
+     * Writes the profile to a file.
+     *
+     * @param filename  The file, replaced if it exists.
+     */
+    void save(const char *filename) const
+    {
+        FILE *fp = fopen(filename, "w");
+        std::map<std::string, uint64_t>::const_iterator it;
+        bool ok = (fp != NULL);
+
+        for (it = counts_.begin(); ok && it != counts_.end(); ++it)
+            ok = fprintf(fp, "%s = %llu\n", it->first.c_str(),
+                         static_cast<unsigned long long>(it->second)) > 0;
+        if (fp != NULL && fclose(fp) != 0)
+            ok = false;
+        if (!ok)
+            throw std::runtime_error(
+                    std::string("can not write access profile ") +
+                    std::string(filename) + std::string("."));
+    }
+
+    /**
+     * Adds the counts saved in a file by save().
+     *
+     * @param filename  The file.
+     */
+    void load(const char *filename)
+    {
+        loader l = { this };
+        scan_file(filename, &l);
+    }
+
+  private:
+    struct loader {
+        access_profile *self;
+
+        void item(string_ref key, string_ref value, size_t)
+        {
+            self->counts_[key.str()] += strtoull(value.str().c_str(),
+                                                 NULL, 10);
+        }
+    };
+
+    std::map<std::string, uint64_t> counts_;
+};
+
+/**
+ * Setting parser.
+ *
+ * @tparam Storage       Holds the raw key-value pairs, see @ref Storage.
+ *                       Allocators are chosen through the storage, e.g.
+ *                       basic_map_storage<my_allocator>.
+ * @tparam ThreadPolicy  Serializes calls, see @ref ThreadPolicy.
+ *
+ * Both are resolved at compile time; lookups make no virtual calls.
+ * Use the setting typedef unless you need another combination.
+ */
+template <class Storage = SETTING_STORAGE,
+          class ThreadPolicy = single_threaded>
+class basic_setting {
   public:
     /**
      * Constructs a setting.
      *
      * @param level Maximum recusion times for parsing variable
      */
-    explicit setting(size_t level = 3): recursion_level_(level) {}
+    explicit basic_setting(size_t level = 3)
+        :recursion_level_(level), hash_(0), resolved_valid_(false),
+         cold_threshold_(0), hot_slots_(1), tick_(0), cache_budget_(0),
+         cache_hand_(0), history_limit_(0), version_(0), last_version_(0),
+         changed_(false), journal_(NULL), journal_sync_(false),
+         compacting_(false), profile_(NULL) {}
 
     /**
      * Constructs a setting with a configuration file.
@@ -100,22 +273,475 @@ class setting {
      * @param s        The filename.
      * @param level    Maximum recusion time for parsing variable.
      */
-    explicit setting(const char *s, size_t level = 3)
-        :recursion_level_(level)
+    explicit basic_setting(const char *s, size_t level = 3)
+        :recursion_level_(level), hash_(0), resolved_valid_(false),
+         cold_threshold_(0), hot_slots_(1), tick_(0), cache_budget_(0),
+         cache_hand_(0), history_limit_(0), version_(0), last_version_(0),
+         changed_(false), journal_(NULL), journal_sync_(false),
+         compacting_(false), profile_(NULL)
     {
         read_from_file(s);
     }
 
+    ~basic_setting()
+    {
+        if (journal_ != NULL)
+            fclose(journal_);
+        for (size_t i = 0; i < history_.size(); i++)
+            delete history_[i];
+    }
+
+#if __cplusplus >= 201103L
+    /** Takes the content of o in constant time, leaving o empty. */
+    basic_setting(basic_setting &&o)
+        :recursion_level_(o.recursion_level_), hash_(0),
+         resolved_valid_(false), cold_threshold_(0), hot_slots_(1),
+         tick_(0), cache_budget_(0), cache_hand_(0), history_limit_(0),
+         version_(0), last_version_(0), changed_(false), journal_(NULL),
+         journal_sync_(false), compacting_(false), profile_(NULL)
+    {
+        swap(o);
+    }
+
+    /** Exchanges the content with o in constant time. */
+    basic_setting& operator=(basic_setting &&o)
+    {
+        swap(o);
+        return *this;
+    }
+#endif
+
+    /**
+     * Exchanges the content of two settings in constant time. This is
+     * how to move a setting in C++98; C++11 builds also get a move
+     * constructor and assignment built on it.
+     *
+     * @param o  The other setting.
+     */
+    void swap(basic_setting &o)
+    {
+        if (this == &o)
+            return;
+        guard g1((this < &o) ? lock_ : o.lock_);
+        guard g2((this < &o) ? o.lock_ : lock_);
+
+        std::swap(recursion_level_, o.recursion_level_);
+        map_.swap(o.map_);
+        std::swap(hash_, o.hash_);
+        std::swap(resolved_hash_, o.resolved_hash_);
+        std::swap(resolved_valid_, o.resolved_valid_);
+        std::swap(cold_threshold_, o.cold_threshold_);
+        cold_.swap(o.cold_);
+        std::swap(hot_slots_, o.hot_slots_);
+        hot_.swap(o.hot_);
+        std::swap(tick_, o.tick_);
+        reserve_.swap(o.reserve_);
+        std::swap(cache_budget_, o.cache_budget_);
+        cache_.swap(o.cache_);
+        cache_index_.swap(o.cache_index_);
+        cache_free_.swap(o.cache_free_);
+        std::swap(cache_hand_, o.cache_hand_);
+        std::swap(cache_stats_, o.cache_stats_);
+        std::swap(history_limit_, o.history_limit_);
+        history_.swap(o.history_);
+        std::swap(version_, o.version_);
+        std::swap(last_version_, o.last_version_);
+        std::swap(changed_, o.changed_);
+        std::swap(journal_, o.journal_);
+        journal_path_.swap(o.journal_path_);
+        std::swap(journal_sync_, o.journal_sync_);
+        std::swap(compacting_, o.compacting_);
+        sources_.swap(o.sources_);
+        outside_.swap(o.outside_);
+        std::swap(profile_, o.profile_);
+    }
+
+    /**
+     * Makes out a copy of this setting. The keys are shared
+     * copy-on-write and writes to either setting afterwards cost only
+     * what they change. The copy takes constant time, plus the keys
+     * written in this setting since it last shared its keys, which are
+     * first moved into the shared base (see shared_storage). Compressed
+     * values are shared the same way, caches start empty.
+     *
+     * @param out  The setting to overwrite with the copy.
+     */
+    void clone(basic_setting *out) const
+    {
+        if (this == out)
+            return;
+        guard g1((this < out) ? lock_ : out->lock_);
+        guard g2((this < out) ? out->lock_ : lock_);
+
+        out->map_.share(map_);
+        out->invalidate();
+        out->recursion_level_ = recursion_level_;
+        out->hash_ = hash_;
+        out->resolved_hash_ = resolved_hash_;
+        out->resolved_valid_ = resolved_valid_;
+        out->cold_threshold_ = cold_threshold_;
+        out->cold_.share(cold_);
+        out->hot_slots_ = hot_slots_;
+        out->hot_.clear();
+        out->cache_budget_ = cache_budget_;
+        out->sources_ = sources_;
+        out->outside_ = outside_;
+        out->changed_ = true;
+        out->record();
+    }
+
+    /**
+     * Makes runtime changes persistent in an append-only journal.
+     *
+     * The journal at path is replayed first on top of what is loaded:
+     * all its entries are applied in bulk, then the storage is committed
+     * once. From then on every operator<<, erase(), committed
+     * transaction, apply_delta() and rollback() appends one entry, a
+     * rollback recording the keys it changes. An entry is a batch of delta
+     * records (see make_delta()) with a length and a checksum, so a
+     * transaction is replayed entirely or not at all, and an entry torn
+     * by a crash is cut off the file at the next open.
+     *
+     * @param path   Filename of the journal, created if missing.
+     * @param sync   true to fsync() after every entry.
+     */
+    void open_journal(const char *path, bool sync = false)
+    {
+        guard g(lock_);
+        std::string payload;
+        long good;
+        FILE *fp;
+
+        if (journal_ != NULL)
+            throw std::runtime_error("journal is already open.");
+        fp = fopen(path, "rb");
+        if (fp != NULL) {
+            good = read_journal_header(fp) ? ftell(fp) : 0;
+            try {
+                while (read_journal_entry(fp, &payload)) {
+                    replay(payload);
+                    good = ftell(fp);
+                }
+            } catch (...) {
+                fclose(fp);
+                throw;
+            }
+            fclose(fp);
+            if (truncate(path, good) != 0)
+                throw std::runtime_error(
+                        std::string("can not truncate journal ") +
+                        std::string(path) + std::string("."));
+            map_.commit();
+            cold_.commit();
+            record();
+        }
+
+        journal_ = open_journal_file(path);
+        journal_path_ = path;
+        journal_sync_ = sync;
+    }
+
+    /**
+     * Rewrites the journal with only the last change of each key, so
+     * that replaying it costs in proportion to the keys changed, not to
+     * the changes made.
+     *
+     * The old entries are read and folded into a new file without
+     * holding the lock of a multi_threaded setting; only the final
+     * switch, which also copies the entries appended in between, does.
+     * Call it from a background thread to keep it off the update path.
+     * The new file replaces the journal by rename(), and both the file
+     * and its directory are fsync()ed so that a crash leaves either the
+     * old or the new journal.
+     */
+    void compact_journal()
+    {
+        std::map<std::string, std::pair<bool, std::string> > last;
+        std::string tmp, payload, entry;
+        long end;
+        FILE *in, *out;
+
+        {
+            guard g(lock_);
+            if (journal_ == NULL || compacting_)
+                return;
+            if (fflush(journal_) != 0)
+                throw_journal_error();
+            end = ftell(journal_);
+            tmp = journal_path_ + ".compact";
+            compacting_ = true;
+        }
+
+        in = out = NULL;
+        try {
+            in = fopen(journal_path_.c_str(), "rb");
+            if (in == NULL || !read_journal_header(in))
+                throw_journal_error();
+            out = open_journal_file(tmp.c_str(), "wb");
+            while (ftell(in) < end && read_journal_entry(in, &payload))
+                fold(payload, &last);
+
+            // one entry of DELTA_CHANGE and DELTA_REMOVE records
+            std::map<std::string, std::pair<bool, std::string> >::iterator it;
+            delta_writer w(this, this);
+            for (it = last.begin(); it != last.end(); ++it) {
+                if (it->second.first)
+                    w.removed(it->first);
+                else
+                    w.put(wire::DELTA_CHANGE, it->first, it->second.second);
+            }
+            if (w.count > 0)
+                write_entry(out, w);
+
+            guard g(lock_);
+            if (fflush(journal_) != 0)
+                throw_journal_error();
+            copy_tail(in, end, out);
+            if (fflush(out) != 0 || fsync(fileno(out)) != 0
+                || rename(tmp.c_str(), journal_path_.c_str()) != 0)
+                throw_journal_error();
+            fclose(journal_);
+            journal_ = out;
+            out = NULL;
+            compacting_ = false;
+            // the rename is only durable once the directory is
+            if (!sync_directory_of(journal_path_))
+                throw_journal_error();
+        } catch (...) {
+            if (out != NULL) {
+                fclose(out);
+                unlink(tmp.c_str());
+            }
+            if (in != NULL)
+                fclose(in);
+            guard g(lock_);
+            compacting_ = false;
+            throw;
+        }
+        fclose(in);
+    }
+
+  protected:
+    struct delta_writer;
+
+  public:
+    /** A validator for transaction::commit() which accepts anything. */
+    struct accept_all {
+        bool operator()(const basic_setting &) const { return true; }
+    };
+
+    /**
+     * A set of changes published all at once.
+     *
+     * Changes are staged on a copy-on-write clone of the target, and
+     * staging and commit() cost what the transaction changes. commit()
+     * validates the staged setting and swaps its keys into the target
+     * with one invalidation of the caches, so the target holds the
+     * staged changes on top of the base it shares; readers never see
+     * part of a transaction. The next clone moves those changes into
+     * the base, which costs what the previous transaction and any
+     * operator<< since changed (see clone()). Dropping a transaction
+     * without commit() discards it.
+     *
+     * @code
+     * dutil::setting::transaction tx(&cfg);
+     * tx << "pool.min = 4" << "pool.max = 8";
+     * if (!tx.commit(check_pool))
+     *     log("pool change rejected");
+     * @endcode
+     */
+    class transaction {
+      public:
+        /** Starts a transaction on target. */
+        explicit transaction(basic_setting *target)
+            :target_(target), log_(&staged_, &staged_), valid_(true),
+             done_(false)
+        {
+            guard g(target->lock_);
+            target->clone(&staged_);
+            base_version_ = target->version_;
+        }
+
+        /**
+         * Stages a line. Comment lines are ignored; a line without '='
+         * or with an empty key makes commit() fail.
+         *
+         * @param line  Text according to @see Syntax.
+         */
+        transaction& operator<< (const std::string &line)
+        {
+            string_ref text = scanner::trim(line);
+            std::string key, value;
+
+            if (!text.empty() && text.data[0] == '#')
+                return *this;
+            if (line.find('=') == line.npos || !split(line, &key, &value)) {
+                valid_ = false;
+            } else {
+                staged_.assign(key, value);
+                log_.put(wire::DELTA_CHANGE, key, value);
+            }
+            return *this;
+        }
+
+        /** Stages the removal of a key. */
+        void erase(const std::string &key)
+        {
+            if (staged_.remove(key))
+                log_.removed(key);
+        }
+
+        /** Returns the setting as it will be after commit(). */
+        const basic_setting& staged() const { return staged_; }
+
+        /** Commits without a validator, see commit(Validator). */
+        bool commit()
+        {
+            return commit(accept_all());
+        }
+
+        /**
+         * Validates and publishes the staged changes. The transaction
+         * fails if a staged line was malformed, if the target changed
+         * since the transaction started, or if validate rejects the
+         * staged setting; the target is then left as it was.
+         *
+         * @param validate  Called as validate(staged()), returns true to
+         *                  accept.
+         * @return true if the changes were published.
+         */
+        template <class Validator>
+        bool commit(Validator validate)
+        {
+            if (done_)
+                return false;
+            done_ = true;
+
+            guard g(target_->lock_);
+            if (!valid_ || target_->version_ != base_version_
+                || !validate(static_cast<const basic_setting &>(staged_)))
+                return false;
+            target_->adopt(&staged_, log_);
+            return true;
+        }
+
+        /** Discards the staged changes. */
+        void rollback()
+        {
+            done_ = true;
+            staged_.map_.clear();
+        }
+
+      private:
+        basic_setting *target_;
+        basic_setting staged_;
+        /** The staged changes, for the journal of the target. */
+        delta_writer log_;
+        uint32_t base_version_;
+        bool valid_;
+        bool done_;
+
+        transaction(const transaction&);
+        void operator=(const transaction&);
+    };
+
+    /**
+     * Keeps the last n versions of this setting for rollback() and
+     * checkout(). Every call that changes the setting makes a new
+     * version, and the current one is kept too.
+     *
+     * With hamt_storage, keeping a version takes constant time, and
+     * versions share every trie node they have in common. With other
+     * storages, versions share a full copy of the keys, and each one
+     * kept after a change copies the keys changed since that copy was
+     * made. A new full copy is made once those reach half the keys.
+     *
+     * @param n  Number of versions to keep, 0 (the default) for none.
+     */
+    void keep_history(size_t n)
+    {
+        guard g(lock_);
+        history_limit_ = n;
+        if (n > 0 && (history_.empty() || history_.back()->id != version_))
+            push_version();
+        trim_history();
+    }
+
+    /** Returns the id of the current version, changed by every update. */
+    uint32_t version() const
+    {
+        return version_;
+    }
+
+    /**
+     * Lists the versions kept by keep_history().
+     *
+     * @param out  Pointer to a std::vector used to store the ids,
+     *             oldest first.
+     */
+    void versions(std::vector<uint32_t> *out) const
+    {
+        guard g(lock_);
+        out->clear();
+        for (size_t i = 0; i < history_.size(); i++)
+            out->push_back(history_[i]->id);
+    }
+
+    /**
+     * Returns to a kept version. Versions after it are still kept, so
+     * a rollback can be undone by another one.
+     *
+     * @param id  The version.
+     * @return true if the version was kept, otherwise false.
+     */
+    bool rollback(uint32_t id)
+    {
+        guard g(lock_);
+        const version_entry *v = find_version(id);
+
+        if (v == NULL)
+            return false;
+        restore_logged(*v, this);
+        version_ = id;
+        changed_ = false;
+        return true;
+    }
+
+    /**
+     * Makes out a copy of a kept version, sharing its keys like clone().
+     * make_delta() between two checkouts gives the difference between
+     * versions; with hamt_storage it skips every subtree they share.
+     *
+     * @param id   The version.
+     * @param out  The setting to overwrite with the copy.
+     * @return true if the version was kept, otherwise false.
+     */
+    bool checkout(uint32_t id, basic_setting *out) const
+    {
+        if (this == out)
+            return const_cast<basic_setting *>(this)->rollback(id);
+        guard g1((this < out) ? lock_ : out->lock_);
+        guard g2((this < out) ? out->lock_ : lock_);
+        const version_entry *v = find_version(id);
+
+        if (v == NULL)
+            return false;
+        restore_logged(*v, out);
+        out->recursion_level_ = recursion_level_;
+        out->changed_ = true;
+        out->record();
+        return true;
+    }
+
     /**
      * Adds a extra line.
      *
      * @param s Text according to @see Syntax.
      * @return A instance of setting.
      */
-    setting& operator<< (const char *s)
+    basic_setting& operator<< (const char *s)
     {
-        insert(std::string(s));
-        return *this;
+        return *this << std::string(s);
     }
 
     /**
@@ -124,9 +750,20 @@ class setting {
      * @param str Text according to @see Syntax.
      * @return A instance of setting.
      */
-    setting& operator<< (const std::string &str)
+    basic_setting& operator<< (const std::string &str)
     {
-        insert(str);
+        guard g(lock_);
+        std::string key, value;
+
+        if (split(str, &key, &value)) {
+            assign(key, value);
+            if (journal_ != NULL) {
+                delta_writer w(this, this);
+                w.put(wire::DELTA_CHANGE, key, value);
+                write_journal(w);
+            }
+        }
+        record();
         return *this;
     }
 
@@ -139,6 +776,7 @@ class setting {
      */
     int get_int(const std::string &key, int defval = 0) const
     {
+        guard g(lock_);
         return (get_value(key))?atoi(reserve_.c_str()):defval;
     }
 
@@ -151,6 +789,7 @@ class setting {
      */
     long get_long(const std::string &key, long defval = 0) const
     {
+        guard g(lock_);
         return (get_value(key))?atol(reserve_.c_str()):defval;
     }
 
@@ -163,6 +802,7 @@ class setting {
      */
     long get_longlong(const std::string &key, long long defval = 0) const
     {
+        guard g(lock_);
         return (get_value(key))?atoll(reserve_.c_str()):defval;
     }
 
@@ -175,6 +815,7 @@ class setting {
      */
     long get_double(const std::string &key, double defval = 0.0) const
     {
+        guard g(lock_);
         return (get_value(key))?strtod(reserve_.c_str(), NULL):defval;
     }
 
@@ -190,9 +831,41 @@ class setting {
     const char* get_cstr(const std::string &key,
                          const char *defval = NULL) const
     {
+        guard g(lock_);
         return (get_value(key))?reserve_.c_str():defval;
     }
 
+    /**
+     * Gets the values of several keys. The storage locations of all keys
+     * are prefetched before the first is read, so their cache misses
+     * overlap instead of adding up, and the lock is taken once.
+     *
+     * @param   keys     The keys.
+     * @param   out      Set to one value per key.
+     * @param   defval   Value given for keys that don't exist.
+     * @return The number of keys that exist.
+     */
+    size_t get_many(const std::vector<std::string> &keys,
+                    std::vector<std::string> *out,
+                    const std::string &defval = std::string()) const
+    {
+        guard g(lock_);
+        size_t found = 0;
+
+        for (size_t i = 0; i < keys.size(); i++)
+            map_.prefetch(keys[i]);
+        out->resize(keys.size());
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (get_value(keys[i])) {
+                (*out)[i].swap(reserve_);
+                found++;
+            } else {
+                (*out)[i] = defval;
+            }
+        }
+        return found;
+    }
+
     /** Gets a value using key and splitted it into a vector by comma.
       *
       * @param   key      The Key.
@@ -202,221 +875,1586 @@ class setting {
       */
     bool get_vector(const std::string &key, std::vector<std::string> *out)
     {
+        guard g(lock_);
         std::string::size_type break_pos, pos;
+        std::vector<std::string> parts;
         std::string s;
+        size_t slot;
 
-        if (get_value(key) == false)
+        if (get_value(key, &slot) == false)
             return false;
+        if (slot != npos && cache_[slot].has_split) {
+            out->insert(out->end(), cache_[slot].split.begin(),
+                        cache_[slot].split.end());
+            return true;
+        }
         for (pos = 0; pos < reserve_.npos; pos = break_pos + 1) {
             break_pos = reserve_.find(',', pos);
             if (break_pos == reserve_.npos)
                 break_pos = reserve_.npos - 1;
             trim(reserve_.substr(pos, break_pos - pos), &s);
             if (!s.empty())
-                out->push_back(s);
+                parts.push_back(s);
         }
+        out->insert(out->end(), parts.begin(), parts.end());
+        if (slot != npos)
+            cache_split(slot, &parts);
         return true;
     }
 
     /**
-     * Dumps configuration text.
+     * Removes a key. Unlike setting it to an empty value, the key no
+     * longer exists for get_* and dump(), and values interpolating it
+     * resolve as if it had never been set. Cached resolutions are
+     * dropped. The storage removes the key in place (open-addressing
+     * backends leave a tombstone, reclaimed by the next load).
      *
-     * @param    out    Pointer to a std::string object used to store
-     *                  the outputs.
+     * @param   key   The Key.
+     * @return true if key existed, otherwise false.
      */
-    void dump(std::string *out) const
+    bool erase(const std::string &key)
     {
-        std::map<std::string, std::string>::const_iterator it;
-        out->clear();
+        guard g(lock_);
+        bool found = remove(key);
 
-        for (it = map_.begin(); it != map_.end(); it++) {
-            out->append(it->first).append(" = ");
-            out->append(it->second).append("\n");
+        if (found && journal_ != NULL) {
+            delta_writer w(this, this);
+            w.removed(key);
+            write_journal(w);
         }
+        record();
+        return found;
     }
 
     /**
-     * Loads a configuration.
+     * Caches resolved values and split vectors within a memory budget.
      *
-     * @param filename Filename of the configuration.
+     * Resolving a value interpolates every $key in it, which is repeated
+     * on each get_* call unless the result is cached. Cached entries are
+     * evicted with the CLOCK policy once the budget is exceeded and
+     * recomputed on demand; raw values are never evicted. Any insert or
+     * erase drops the whole cache.
+     *
+     * @param bytes  Memory budget, 0 to disable caching (the default).
      */
-    void read_from_file(const char *filename)
+    void set_cache_budget(size_t bytes)
     {
-        std::ifstream ifs(filename);
-        if (ifs.is_open()) {
-            std::string line, trimmed_line;
-            while (!(std::getline(ifs, line).eof())) {
-                trim(line, &trimmed_line);
-                if (!trimmed_line.empty() && trimmed_line[0] != '#')
-                    insert(trimmed_line);
-            }
-        } else {
-            throw std::runtime_error(
-                    std::string("can not open configuration file ") +
-                    std::string(filename) + std::string("."));
-        }
+        guard g(lock_);
+        cache_budget_ = bytes;
+        cache_evict(0, npos);
     }
 
-  protected:
-    /** Internal Key-Value type. */
-    typedef std::map<std::string, std::string> item_type;
-    /** Maximum Recursion Level. */
-    size_t recursion_level_;
-    /** Internal Key-Value Map. */
-    item_type map_;
-    /** Temporary string. */
-    mutable std::string reserve_;
-
     /**
-     * Trims a string, removes its heading nand trailing white-spaces.
+     * Counts the key of every get_* call into a profile, to be saved
+     * after a warmup run and given to optimize_layout() or
+     * serialize() later.
      *
-     * @param  s     The string.
-     * @param  out   Pointer to a std::string object to hold the trimmed
-     *               string.
+     * @param profile  The profile, NULL to stop counting. It must
+     *                 outlive the counting.
      */
-    static void trim(const std::string &s, std::string *out)
+    void set_profile(access_profile *profile)
     {
-        static const char       whitespace[] = " \t\r\n";
-        std::string::size_type  begin;
-        std::string::size_type  end;
-
-        out->clear();
-        begin = s.find_first_not_of(whitespace);
-        if (begin == s.npos)
-            return;
-        end = s.find_last_not_of(whitespace);
-        *out = s.substr(begin, end + 1);
+        guard g(lock_);
+        profile_ = profile;
     }
 
     /**
-     * Tests if ch is an identifier.
+     * Rebuilds the storage with the keys most read in a profile
+     * inserted first. Storages that keep insertion order in memory,
+     * such as inline_storage, then hold the hot keys next to each
+     * other, the nodes of map_storage are allocated together, and the
+     * hot keys of hash_storage get the shortest probe sequences. Values
+     * of keys never read are compressed as by set_cold_storage().
+     * The layout lasts until the setting is next copied.
      *
-     * @param ch The char to be tested.
-     * @return true if it is an identifier.
+     * @param profile  Reads of each key, see set_profile().
      */
-    static bool check_identifier(const char ch)
+    void optimize_layout(const access_profile &profile)
     {
-        return (isalnum(ch) || (ch) == '_');
+        guard g(lock_);
+        std::vector<std::pair<uint64_t, std::string> > order;
+        item_type fresh;
+        string_ref raw;
+
+        rank(profile, &order);
+        for (size_t i = 0; i < order.size(); i++) {
+            map_.find(order[i].second, &raw);
+            fresh.set(order[i].second, raw);
+        }
+        fresh.commit();
+        map_.swap(fresh);
+        for (size_t i = 0; i < order.size(); i++) {
+            const std::string &key = order[i].second;
+            if (order[i].first == unread && map_.find(key, &raw)
+                && !raw.empty())
+                make_cold(key, raw, entry_hash(key, raw));
+        }
     }
 
-    /**
-     * Gets a value into reserve_ using key.
-     *
-     * @param    key    The Key.
-     * @return   true if key exists, otherwise false.
-     */
-    bool get_value(const std::string &key) const
+    /** Returns the hit, miss and eviction counters of the cache. */
+    const cache_stats& cache_statistics() const
     {
-        item_type::const_iterator found = map_.find(key);
-        if (found != map_.end()) {
-            parse_recursive(found->second, &reserve_);
-            return true;
-        }
-        return false;
+        return cache_stats_;
     }
 
     /**
-     * Adds an extra line to setting.
+     * Dumps configuration text.
      *
-     * @param s Text according to @see Syntax.
-     * @return A instance of setting.
+     * @param    out       Pointer to a std::string object used to store
+     *                     the outputs.
+     * @param    sections  If true, keys are grouped under "[section]"
+     *                     lines named after all but their last dotted
+     *                     segment; otherwise every key is written whole.
      */
-    void insert(const std::string &s)
+    void dump(std::string *out, bool sections = false) const
     {
-        int break_pos = s.find("=");
-        std::string key;
-        std::string value;
-
-        trim(s.substr(0, break_pos), &key);
-        trim(s.substr(break_pos + 1), &value);
+        guard g(lock_);
+        typename item_type::const_iterator it;
+        std::map<std::string, std::string> grouped;
+        std::map<std::string, std::string>::const_iterator group;
+        string_ref key, value;
+        out->clear();
 
-        if (!key.empty())
-            map_[key] = value;
+        for (it = map_.begin(); it != map_.end(); ++it) {
+            key = it.key();
+            value = value_of(key, it.value());
+            if (!sections) {
+                append_item(out, key, value);
+                continue;
+            }
+            const char *dot = static_cast<const char *>(
+                    memrchr(key.data, '.', key.size));
+            std::string *text = &grouped[""];
+            // keys starting or ending with a dot can only be written whole
+            if (dot != NULL && dot != key.data
+                && dot != key.data + key.size - 1) {
+                text = &grouped[std::string(key.data, dot - key.data)];
+                key = string_ref(dot + 1, key.data + key.size - dot - 1);
+            }
+            append_item(text, key, value);
+        }
+        for (group = grouped.begin(); group != grouped.end(); ++group) {
+            if (!group->first.empty()) {
+                if (!out->empty())
+                    out->append("\n");
+                out->append("[").append(group->first).append("]\n");
+            }
+            out->append(group->second);
+        }
     }
 
     /**
-     * Parses a string.
+     * Returns the number of keys.
+     */
+    size_t size() const
+    {
+        guard g(lock_);
+        return map_.size();
+    }
+
+    /**
+     * Serializes raw (unparsed) key-value pairs into a binary snapshot.
+     *
+     * @param    out    Pointer to a std::string object used to store
+     *                  the outputs.
+     */
+    void serialize(std::string *out) const
+    {
+        guard g(lock_);
+        typename item_type::const_iterator it;
+
+        out->clear();
+        wire::put_u32(out, static_cast<uint32_t>(map_.size()));
+        for (it = map_.begin(); it != map_.end(); ++it) {
+            string_ref value = value_of(it.key(), it.value());
+            wire::put_bytes(out, it.key().data, it.key().size);
+            wire::put_bytes(out, value.data, value.size);
+        }
+    }
+
+    /**
+     * Serializes raw key-value pairs into a binary snapshot with the
+     * keys most read in a profile first and unread keys last, so that
+     * loading it lays out the hot keys together. Any snapshot is read
+     * by deserialize().
+     *
+     * @param    out      Pointer to a std::string object used to store
+     *                    the outputs.
+     * @param    profile  Reads of each key, see set_profile().
+     */
+    void serialize(std::string *out, const access_profile &profile) const
+    {
+        guard g(lock_);
+        std::vector<std::pair<uint64_t, std::string> > order;
+        string_ref raw;
+
+        rank(profile, &order);
+        out->clear();
+        wire::put_u32(out, static_cast<uint32_t>(order.size()));
+        for (size_t i = 0; i < order.size(); i++) {
+            map_.find(order[i].second, &raw);
+            raw = value_of(order[i].second, raw);
+            wire::put_bytes(out, order[i].second.data(),
+                            order[i].second.size());
+            wire::put_bytes(out, raw.data, raw.size);
+        }
+    }
+
+    /**
+     * Loads key-value pairs from a snapshot made by serialize(). Keys
+     * already present are overwritten.
+     *
+     * @param data  The snapshot.
+     * @param size  Size of the snapshot in bytes.
+     */
+    void deserialize(const char *data, size_t size)
+    {
+        guard g(lock_);
+        wire::reader in(data, size);
+        std::string key, value;
+
+        for (uint32_t n = in.get_u32(); n > 0; n--) {
+            in.get_string(&key);
+            in.get_string(&value);
+            assign(key, value);
+        }
+        map_.commit();
+        cold_.commit();
+        record();
+    }
+
+    /**
+     * Returns a fingerprint of all raw key-value pairs. Two settings
+     * with the same content have the same fingerprint, whatever order
+     * the keys were inserted in. It is kept up to date by every insert,
+     * so this call is O(1).
+     *
+     * @return The fingerprint.
+     */
+    uint64_t fingerprint() const
+    {
+        guard g(lock_);
+        return hash_;
+    }
+
+    /**
+     * Returns a fingerprint of all resolved (parsed) values. Settings
+     * whose raw text differs but which resolve to the same values, such
+     * as "a = $b" and "a = 1" with "b = 1", share this fingerprint.
+     * Computed on the first call after a change, then O(1).
+     *
+     * @return The fingerprint.
+     */
+    uint64_t resolved_fingerprint() const
+    {
+        guard g(lock_);
+        typename item_type::const_iterator it;
+        std::string value;
+
+        if (!resolved_valid_) {
+            resolved_hash_ = 0;
+            for (it = map_.begin(); it != map_.end(); ++it) {
+                parse_recursive(value_of(it.key(), it.value()), &value);
+                resolved_hash_ += entry_hash(it.key(), value);
+            }
+            resolved_valid_ = true;
+        }
+        return resolved_hash_;
+    }
+
+    /**
+     * Produces a binary delta which turns from into to. The delta
+     * carries the fingerprints of both states and one record per added,
+     * changed or removed key, so its size depends only on the change.
+     *
+     * @param    from   The base state.
+     * @param    to     The target state.
+     * @param    out    Pointer to a std::string object used to store
+     *                  the delta.
+     */
+    static void make_delta(const basic_setting &from,
+                           const basic_setting &to,
+                           std::string *out)
+    {
+        // lock in address order so that two threads diffing the same
+        // pair in opposite directions can not deadlock
+        guard g1((&from < &to) ? from.lock_ : to.lock_);
+        guard g2((&from < &to) ? to.lock_ : from.lock_);
+        delta_writer w(&from, &to);
+
+        item_type::diff(from.map_, to.map_, &w);
+        out->clear();
+        wire::put_u32(out, wire::delta_magic);
+        wire::put_u64(out, from.fingerprint());
+        wire::put_u64(out, to.fingerprint());
+        wire::put_u32(out, w.count);
+        out->append(w.records);
+        wire::put_u64(out, wire::hash_bytes(wire::hash_seed,
+                                            out->data(), out->size()));
+    }
+
+    /**
+     * Applies a delta made by make_delta() in place. The delta is
+     * rejected with a std::runtime_error if it is corrupted or if this
+     * setting is not the state it was made against.
+     *
+     * @param data  The delta.
+     * @param size  Size of the delta in bytes.
+     */
+    void apply_delta(const char *data, size_t size)
+    {
+        guard g(lock_);
+        if (size < 8)
+            throw std::runtime_error("truncated binary data.");
+        wire::reader tail(data + size - 8, 8);
+        if (tail.get_u64() != wire::hash_bytes(wire::hash_seed,
+                                               data, size - 8))
+            throw std::runtime_error("delta checksum mismatch.");
+
+        wire::reader in(data, size - 8);
+        if (in.get_u32() != wire::delta_magic)
+            throw std::runtime_error("not a delta.");
+        if (in.get_u64() != fingerprint())
+            throw std::runtime_error("delta base does not match.");
+        uint64_t target = in.get_u64();
+
+        std::string key, value;
+        delta_writer log(this, this);
+        for (uint32_t n = in.get_u32(); n > 0; n--) {
+            uint8_t kind = in.get_u8();
+            in.get_string(&key);
+            if (kind == wire::DELTA_REMOVE) {
+                if (remove(key))
+                    log.removed(key);
+            } else {
+                in.get_string(&value);
+                assign(key, value);
+                log.put(wire::DELTA_CHANGE, key, value);
+            }
+        }
+        if (journal_ != NULL)
+            write_journal(log);
+        map_.commit();
+        cold_.commit();
+        record();
+        if (fingerprint() != target)
+            throw std::runtime_error("delta target does not match.");
+    }
+
+    /**
+     * Reports the memory used by this setting.
+     *
+     * Key and value bytes are exact; tree nodes, string headers and
+     * allocator slack are estimates of what the C++ library and malloc
+     * use. Costs which belong to no single key, such as hash tables and
+     * caches, only appear in the total.
+     *
+     * @param total      Pointer to a memory_stats object to hold the
+     *                   total.
+     * @param by_prefix  If not NULL, gets the memory of the keys under
+     *                   each prefix, such as "core" for "core.alpha".
+     * @param depth      Number of dot-separated segments in a prefix.
+     */
+    void memory_usage(memory_stats *total,
+                      std::map<std::string, memory_stats> *by_prefix = NULL,
+                      size_t depth = 1) const
+    {
+        guard g(lock_);
+        memory_visitor v(total, by_prefix, depth);
+        cold_visitor cv = { &v };
+        memory_stats shared;
+
+        *total = memory_stats();
+        map_.memory(&v);
+        cold_.memory(&cv);
+        for (size_t i = 0; i < hot_.size(); i++)
+            shared.caches += sizeof(hot_value) + hot_[i].key.capacity()
+                             + hot_[i].value.capacity();
+        shared.caches += reserve_.capacity() + cache_stats_.bytes;
+        shared.overhead = sizeof(*this) - sizeof(map_);
+        v.shared(shared);
+    }
+
+    /**
+     * Keeps long values compressed in memory, for configurations
+     * dominated by large, rarely read values such as certificates. A
+     * compressed value is decompressed when it is read and kept in a
+     * small LRU of hot values. Needs SETTING_HAVE_ZLIB; otherwise
+     * values are stored as they are.
+     *
+     * @param threshold  Values longer than this many bytes are
+     *                   compressed, including those already stored.
+     *                   0 stops compressing new values.
+     * @param hot_slots  Number of decompressed values to keep.
+     */
+    void set_cold_storage(size_t threshold, size_t hot_slots = 8)
+    {
+        guard g(lock_);
+        typename item_type::const_iterator it;
+        std::vector<std::string> keys;
+        string_ref value;
+
+        cold_threshold_ = threshold;
+        hot_slots_ = (hot_slots > 0)?hot_slots:1;
+        hot_.clear();
+        hot_.reserve(hot_slots_);
+        if (threshold == 0)
+            return;
+        // collect first, make_cold() modifies the storage
+        for (it = map_.begin(); it != map_.end(); ++it)
+            if (it.value().size > threshold)
+                keys.push_back(it.key().str());
+        for (size_t i = 0; i < keys.size(); i++) {
+            map_.find(keys[i], &value);
+            make_cold(keys[i], value, entry_hash(keys[i], value));
+        }
+    }
+
+    /**
+     * Loads a configuration.
+     *
+     * The file is tokenized by scanner in chunks, so no copy of the
+     * whole file is ever held in memory; gzip and zstd compressed files
+     * are decompressed on the fly, see scanner::scan_file().
+     *
+     * @param filename Filename of the configuration.
+     */
+    void read_from_file(const char *filename)
+    {
+        guard g(lock_);
+        loader l = { this };
+
+        scanner().scan_file(filename, &l);
+        map_.commit();
+        cold_.commit();
+        record();
+    }
+
+    /**
+     * Loads only the keys of a configuration that match a projection.
+     * Other lines are skipped before they are trimmed or copied, so
+     * they cost neither time nor memory beyond reading them.
+     *
+     * Keys outside the projection are not part of the setting, but
+     * values loaded here may still refer to them: the first reference
+     * to such a key scans the file again for it and remembers the
+     * result.
+     *
+     * @param filename Filename of the configuration.
+     * @param keys     The keys to load.
+     */
+    void read_from_file(const char *filename, const projection &keys)
+    {
+        guard g(lock_);
+        loader l = { this };
+
+        scanner(&keys).scan_file(filename, &l);
+        map_.commit();
+        cold_.commit();
+        source src = { filename, keys };
+        sources_.push_back(src);
+        outside_.clear();
+        record();
+    }
+
+  protected:
+    /** Sums storage memory reports into a total and per prefix. */
+    struct memory_visitor {
+        memory_stats *total;
+        std::map<std::string, memory_stats> *by_prefix;
+        size_t depth;
+
+        memory_visitor(memory_stats *t,
+                       std::map<std::string, memory_stats> *p, size_t d)
+            :total(t), by_prefix(p), depth(d) {}
+
+        void entry(string_ref key, const memory_stats &m)
+        {
+            *total += m;
+            if (by_prefix == NULL)
+                return;
+            size_t end = 0;
+            for (size_t n = 0; n < depth && end < key.size; n++) {
+                const char *dot = static_cast<const char *>(
+                        memchr(key.data + end + 1, '.', key.size - end - 1));
+                end = (dot == NULL) ? key.size : dot - key.data;
+            }
+            (*by_prefix)[std::string(key.data, end)] += m;
+        }
+
+        void shared(const memory_stats &m)
+        {
+            *total += m;
+        }
+    };
+
+    /**
+     * Reports the memory of cold_ to a memory_visitor. The keys were
+     * counted in map_ already; the compressed bytes stand in for their
+     * empty stored values.
+     */
+    struct cold_visitor {
+        memory_visitor *v;
+
+        void entry(string_ref key, memory_stats m)
+        {
+            m.count = 0;
+            v->entry(key, m);
+        }
+
+        void shared(const memory_stats &m)
+        {
+            v->shared(m);
+        }
+    };
+
+    /** Remembers the last value of one key found by scanner. */
+    struct finder {
+        const std::string *key;
+        std::pair<bool, std::string> *result;
+
+        void item(string_ref k, string_ref value, size_t)
+        {
+            if (k != string_ref(*key))
+                return;
+            result->first = true;
+            result->second.assign(value.data, value.size);
+        }
+    };
+
+    /** Stores the items found by scanner. */
+    struct loader {
+        basic_setting *self;
+
+        void item(string_ref key, string_ref value, size_t)
+        {
+            self->assign(key.str(), value.str());
+        }
+    };
+
+    /** Internal Key-Value storage, see @ref Storage. */
+    typedef shared_storage<Storage> item_type;
+    /** Maximum Recursion Level. */
+    size_t recursion_level_;
+    /** Internal Key-Value Map. */
+    item_type map_;
+    /** Sum of entry_hash() over map_. */
+    uint64_t hash_;
+    /** Sum of entry_hash() over resolved values, if resolved_valid_. */
+    mutable uint64_t resolved_hash_;
+    mutable bool resolved_valid_;
+
+    /**
+     * A value kept compressed in memory, stored in cold_ as its size and
+     * hash followed by the compressed bytes.
+     */
+    struct cold_value {
+        string_ref data;    ///< Compressed bytes.
+        uint64_t size;      ///< Size of the raw value.
+        uint64_t hash;      ///< entry_hash() of the raw value.
+    };
+    /**
+     * Compressed values by key, shared copy-on-write with clones and
+     * kept versions like the keys.
+     */
+    typedef item_type cold_type;
+    /** A decompressed cold value. */
+    struct hot_value {
+        std::string key;
+        std::string value;
+        uint64_t used;      ///< tick_ of the last access.
+    };
+    /** Values longer than this are compressed, 0 for never. */
+    size_t cold_threshold_;
+    /** Compressed values. Their map_ entries hold an empty value. */
+    cold_type cold_;
+    /** Capacity of hot_. */
+    size_t hot_slots_;
+    /** Recently used decompressed values, least recently used evicted. */
+    mutable std::vector<hot_value> hot_;
+    mutable uint64_t tick_;
+    /** Temporary string. */
+    mutable std::string reserve_;
+    /** Serializes public calls. */
+    mutable ThreadPolicy lock_;
+    typedef typename ThreadPolicy::guard guard;
+
+    static const size_t npos = static_cast<size_t>(-1);
+
+    /** Derived data of one key. */
+    struct cache_entry {
+        std::string key;            ///< Empty if the slot is free.
+        std::string resolved;
+        std::vector<std::string> split;
+        bool has_split;
+        bool referenced;            ///< CLOCK bit.
+        size_t bytes;
+    };
+    /** Budget of cache_ in bytes, 0 for no caching. */
+    size_t cache_budget_;
+    /** CLOCK ring of cached entries. */
+    mutable std::vector<cache_entry> cache_;
+    /** Key to slot in cache_. */
+    mutable std::map<std::string, size_t> cache_index_;
+    /** Free slots in cache_. */
+    mutable std::vector<size_t> cache_free_;
+    mutable size_t cache_hand_;
+    mutable cache_stats cache_stats_;
+
+    /** A version kept by keep_history(). */
+    struct version_entry {
+        uint32_t id;
+        item_type keys;
+        uint64_t hash;
+        cold_type cold;
+    };
+    /** Number of versions to keep, 0 for none. */
+    size_t history_limit_;
+    /** Kept versions, oldest first. */
+    std::vector<version_entry *> history_;
+    /** Id of the current content. */
+    uint32_t version_;
+    /** Largest id handed out. */
+    uint32_t last_version_;
+    /** Set by assign() and remove(), cleared by record(). */
+    bool changed_;
+
+    /** Journal opened for appending, see open_journal(). */
+    FILE *journal_;
+    std::string journal_path_;
+    bool journal_sync_;
+    /** Set while compact_journal() runs. */
+    bool compacting_;
+
+    /** Counts reads if not NULL, see set_profile(). */
+    access_profile *profile_;
+
+    /** A file loaded with a projection. */
+    struct source {
+        std::string filename;
+        projection keys;
+    };
+    /** Files loaded with a projection, in loading order. */
+    std::vector<source> sources_;
+    /** Keys outside the projections looked up in sources_, found or not. */
+    mutable std::map<std::string, std::pair<bool, std::string> > outside_;
+
+    /** Turns the reports of item_type::diff() into delta records. */
+    struct delta_writer {
+        const basic_setting *from;
+        const basic_setting *to;
+        std::string records;
+        uint32_t count;
+
+        delta_writer(const basic_setting *f, const basic_setting *t)
+            :from(f), to(t), count(0) {}
+
+        void removed(string_ref key)
+        {
+            wire::put_u8(&records, wire::DELTA_REMOVE);
+            wire::put_bytes(&records, key.data, key.size);
+            count++;
+        }
+
+        void added(string_ref key, string_ref raw)
+        {
+            put(wire::DELTA_ADD, key, to->value_of(key, raw));
+        }
+
+        void common(string_ref key, string_ref raw_from, string_ref raw_to)
+        {
+            if (from->entry_hash_of(key, raw_from)
+                != to->entry_hash_of(key, raw_to))
+                put(wire::DELTA_CHANGE, key, to->value_of(key, raw_to));
+        }
+
+        void put(uint8_t kind, string_ref key, string_ref value)
+        {
+            wire::put_u8(&records, kind);
+            wire::put_bytes(&records, key.data, key.size);
+            wire::put_bytes(&records, value.data, value.size);
+            count++;
+        }
+    };
+
+    /**
+     * Trims a string, removes its heading nand trailing white-spaces.
+     *
+     * @param  s     The string.
+     * @param  out   Pointer to a std::string object to hold the trimmed
+     *               string.
+     */
+    static void trim(const std::string &s, std::string *out)
+    {
+        string_ref r = scanner::trim(s);
+        out->assign(r.data, r.size);
+    }
+
+    /**
+     * Tests if ch is an identifier.
+     *
+     * @param ch The char to be tested.
+     * @return true if it is an identifier.
+     */
+    static bool check_identifier(const char ch)
+    {
+        return (isalnum(ch) || (ch) == '_');
+    }
+
+    /**
+     * Gets a value into reserve_ using key.
+     *
+     * @param    key    The Key.
+     * @param    slot   If not NULL, set to the cache slot of key or to
+     *                  npos if it is not cached.
+     * @return   true if key exists, otherwise false.
+     */
+    bool get_value(const std::string &key, size_t *slot = NULL) const
+    {
+        std::map<std::string, size_t>::const_iterator cached;
+        string_ref raw;
+
+        if (slot != NULL)
+            *slot = npos;
+        if (profile_ != NULL)
+            profile_->hit(key);
+        if (cache_budget_ > 0) {
+            cached = cache_index_.find(key);
+            if (cached != cache_index_.end()) {
+                cache_stats_.hits++;
+                cache_[cached->second].referenced = true;
+                reserve_ = cache_[cached->second].resolved;
+                if (slot != NULL)
+                    *slot = cached->second;
+                return true;
+            }
+            cache_stats_.misses++;
+        }
+        if (!map_.find(key, &raw))
+            return false;
+        parse_recursive(value_of(key, raw), &reserve_);
+        if (cache_budget_ > 0) {
+            size_t s = cache_put(key);
+            if (slot != NULL)
+                *slot = s;
+        }
+        return true;
+    }
+
+    /** Estimates the memory of a cache entry, its index node included. */
+    static size_t cache_entry_bytes(const cache_entry &e)
+    {
+        size_t bytes = sizeof(e) + heap_block(4 * sizeof(void *)
+                + sizeof(std::pair<const std::string, size_t>))
+                + 2 * e.key.capacity() + e.resolved.capacity()
+                + e.split.capacity() * sizeof(std::string);
+        for (size_t i = 0; i < e.split.size(); i++)
+            bytes += e.split[i].capacity();
+        return bytes;
+    }
+
+    /**
+     * Caches reserve_ as the resolved value of key.
+     *
+     * @return The slot of the entry, npos if it does not fit.
+     */
+    size_t cache_put(const std::string &key) const
+    {
+        cache_entry e;
+        size_t slot;
+
+        e.key = key;
+        e.resolved = reserve_;
+        e.has_split = false;
+        e.referenced = false;
+        e.bytes = cache_entry_bytes(e);
+        if (e.bytes > cache_budget_)
+            return npos;
+        cache_evict(e.bytes, npos);
+
+        if (cache_free_.empty()) {
+            slot = cache_.size();
+            cache_.push_back(cache_entry());
+        } else {
+            slot = cache_free_.back();
+            cache_free_.pop_back();
+        }
+        cache_[slot].key.swap(e.key);
+        cache_[slot].resolved.swap(e.resolved);
+        cache_[slot].has_split = false;
+        cache_[slot].referenced = false;
+        cache_[slot].bytes = e.bytes;
+        cache_index_[key] = slot;
+        cache_stats_.bytes += e.bytes;
+        return slot;
+    }
+
+    /** Moves a split vector into a cache entry, if it fits. */
+    void cache_split(size_t slot, std::vector<std::string> *parts) const
+    {
+        cache_entry &e = cache_[slot];
+
+        e.split.swap(*parts);
+        size_t bytes = cache_entry_bytes(e);
+        if (bytes > cache_budget_) {
+            e.split.swap(*parts);
+            return;
+        }
+        cache_evict(bytes - e.bytes, slot);
+        e.has_split = true;
+        cache_stats_.bytes += bytes - e.bytes;
+        e.bytes = bytes;
+    }
+
+    /**
+     * Evicts entries with the CLOCK policy until need more bytes fit in
+     * the budget.
+     *
+     * @param need   Bytes about to be added.
+     * @param pin    Slot which must not be evicted, or npos.
+     */
+    void cache_evict(size_t need, size_t pin) const
+    {
+        while (cache_stats_.bytes + need > cache_budget_
+               && cache_stats_.bytes > 0) {
+            if (cache_hand_ >= cache_.size())
+                cache_hand_ = 0;
+            cache_entry &e = cache_[cache_hand_];
+            if (!e.key.empty() && cache_hand_ != pin) {
+                if (e.referenced) {
+                    e.referenced = false;
+                } else {
+                    cache_index_.erase(e.key);
+                    cache_stats_.bytes -= e.bytes;
+                    cache_stats_.evictions++;
+                    std::string().swap(e.key);
+                    std::string().swap(e.resolved);
+                    std::vector<std::string>().swap(e.split);
+                    cache_free_.push_back(cache_hand_);
+                }
+            } else if (cache_hand_ == pin && cache_stats_.bytes == e.bytes) {
+                break;
+            }
+            cache_hand_++;
+        }
+    }
+
+    /** Rank of keys never read, see rank(). */
+    static const uint64_t unread = ~static_cast<uint64_t>(0);
+
+    /**
+     * Lists the keys, most read first and in key order among equally
+     * read keys. The first member of each pair is the complement of the
+     * number of reads, so unread keys have rank unread.
+     */
+    void rank(const access_profile &profile,
+              std::vector<std::pair<uint64_t, std::string> > *order) const
+    {
+        typename item_type::const_iterator it;
+
+        order->clear();
+        order->reserve(map_.size());
+        for (it = map_.begin(); it != map_.end(); ++it) {
+            std::string key = it.key().str();
+            order->push_back(std::make_pair(~profile.count(key), key));
+        }
+        std::stable_sort(order->begin(), order->end());
+    }
+
+    /** Drops derived data after the raw values changed. */
+    void invalidate()
+    {
+        resolved_valid_ = false;
+        if (cache_index_.empty())
+            return;
+        cache_.clear();
+        cache_index_.clear();
+        cache_free_.clear();
+        cache_hand_ = 0;
+        cache_stats_.bytes = 0;
+    }
+
+    /**
+     * Adds an extra line to setting.
+     *
+     * @param s Text according to @see Syntax.
+     * @return A instance of setting.
+     */
+    void insert(const std::string &s)
+    {
+        std::string key;
+        std::string value;
+
+        if (split(s, &key, &value))
+            assign(key, value);
+    }
+
+    /**
+     * Splits a line into its key and value.
+     *
+     * @return true if the key is not empty and the line is not a
+     *         comment.
+     */
+    static bool split(const std::string &s, std::string *key,
+                      std::string *value)
+    {
+        std::string quoted;
+        string_ref k, v;
+
+        scanner::split(s, &k, &v);
+        v = scanner::unquote(v, &quoted);
+        key->assign(k.data, k.size);
+        value->assign(v.data, v.size);
+        return !key->empty() && (*key)[0] != '#';
+    }
+
+    void throw_journal_error() const
+    {
+        throw std::runtime_error(std::string("can not write journal ") +
+                                 journal_path_ + std::string("."));
+    }
+
+    /**
+     * Opens a journal for appending, writing the header if the file is
+     * new.
+     */
+    /** fsync()s the directory holding path. */
+    static bool sync_directory_of(const std::string &path)
+    {
+        std::string::size_type slash = path.rfind('/');
+        std::string dir = slash == std::string::npos ? std::string(".")
+                          : slash == 0 ? std::string("/")
+                          : path.substr(0, slash);
+        int fd = open(dir.c_str(), O_RDONLY);
+        bool ok;
+
+        if (fd < 0)
+            return false;
+        ok = fsync(fd) == 0;
+        close(fd);
+        return ok;
+    }
+
+    static FILE *open_journal_file(const char *path, const char *mode = "ab")
+    {
+        std::string header;
+        FILE *fp = fopen(path, mode);
+
+        if (fp == NULL)
+            throw std::runtime_error(
+                    std::string("can not open journal ") +
+                    std::string(path) + std::string("."));
+        fseek(fp, 0, SEEK_END);
+        if (ftell(fp) == 0) {
+            wire::put_u32(&header, wire::journal_magic);
+            if (fwrite(header.data(), 1, header.size(), fp) != header.size()
+                || fflush(fp) != 0) {
+                fclose(fp);
+                throw std::runtime_error(
+                        std::string("can not write journal ") +
+                        std::string(path) + std::string("."));
+            }
+        }
+        return fp;
+    }
+
+    static bool read_journal_header(FILE *fp)
+    {
+        char buf[4];
+        if (fread(buf, 1, 4, fp) != 4)
+            return false;
+        if (wire::reader(buf, 4).get_u32() != wire::journal_magic)
+            throw std::runtime_error("not a journal.");
+        return true;
+    }
+
+    /**
+     * Reads the payload of the next entry.
+     *
+     * @return false at the end of the journal or at a torn entry.
+     */
+    static bool read_journal_entry(FILE *fp, std::string *payload)
+    {
+        char buf[8];
+        uint32_t len;
+
+        if (fread(buf, 1, 4, fp) != 4)
+            return false;
+        len = wire::reader(buf, 4).get_u32();
+        if (len > wire::max_frame_size)
+            return false;
+        payload->resize(len);
+        if ((len > 0 && fread(&(*payload)[0], 1, len, fp) != len)
+            || fread(buf, 1, 8, fp) != 8)
+            return false;
+        return wire::reader(buf, 8).get_u64()
+               == wire::hash_bytes(wire::hash_seed, payload->data(), len);
+    }
+
+    /** Appends the records of w as one entry. */
+    static void write_entry(FILE *fp, const delta_writer &w)
+    {
+        std::string entry;
+
+        wire::put_u32(&entry, 0);
+        wire::put_u32(&entry, w.count);
+        entry.append(w.records);
+        uint32_t len = static_cast<uint32_t>(entry.size() - 4);
+        for (int i = 0; i < 4; i++)
+            entry[i] = static_cast<char>((len >> (i * 8)) & 0xff);
+        wire::put_u64(&entry, wire::hash_bytes(wire::hash_seed,
+                                               entry.data() + 4, len));
+        if (fwrite(entry.data(), 1, entry.size(), fp) != entry.size())
+            throw std::runtime_error("can not write journal.");
+    }
+
+    void write_journal(const delta_writer &w)
+    {
+        if (w.count == 0)
+            return;
+        write_entry(journal_, w);
+        if (fflush(journal_) != 0
+            || (journal_sync_ && fsync(fileno(journal_)) != 0))
+            throw_journal_error();
+    }
+
+    /** Applies the records of a journal entry. */
+    void replay(const std::string &payload)
+    {
+        wire::reader in(payload.data(), payload.size());
+        std::string key, value;
+
+        for (uint32_t n = in.get_u32(); n > 0; n--) {
+            uint8_t kind = in.get_u8();
+            in.get_string(&key);
+            if (kind == wire::DELTA_REMOVE) {
+                remove(key);
+            } else {
+                in.get_string(&value);
+                assign(key, value);
+            }
+        }
+    }
+
+    /** Folds the records of a journal entry into the last change per key. */
+    static void fold(const std::string &payload,
+                     std::map<std::string, std::pair<bool, std::string> > *last)
+    {
+        wire::reader in(payload.data(), payload.size());
+        std::string key;
+
+        for (uint32_t n = in.get_u32(); n > 0; n--) {
+            uint8_t kind = in.get_u8();
+            in.get_string(&key);
+            std::pair<bool, std::string> &change = (*last)[key];
+            change.first = (kind == wire::DELTA_REMOVE);
+            change.second.clear();
+            if (!change.first)
+                in.get_string(&change.second);
+        }
+    }
+
+    /** Copies the journal from offset start to its end into out. */
+    void copy_tail(FILE *in, long start, FILE *out) const
+    {
+        char buf[65536];
+        size_t n;
+
+        if (fseek(in, start, SEEK_SET) != 0)
+            throw_journal_error();
+        while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+            if (fwrite(buf, 1, n, out) != n)
+                throw_journal_error();
+    }
+
+    /**
+     * Ends an update: gives the content a new version id if it changed
+     * and keeps it if keep_history() asks so.
+     */
+    void record()
+    {
+        if (!changed_)
+            return;
+        changed_ = false;
+        version_ = ++last_version_;
+        if (history_limit_ > 0) {
+            push_version();
+            trim_history();
+        }
+    }
+
+    void push_version()
+    {
+        version_entry *v = new version_entry;
+        v->id = version_;
+        v->keys.share(map_);
+        v->hash = hash_;
+        v->cold.share(cold_);
+        history_.push_back(v);
+    }
+
+    void trim_history()
+    {
+        size_t drop = (history_.size() > history_limit_)
+                      ? history_.size() - history_limit_ : 0;
+        for (size_t i = 0; i < drop; i++)
+            delete history_[i];
+        history_.erase(history_.begin(), history_.begin() + drop);
+    }
+
+    const version_entry *find_version(uint32_t id) const
+    {
+        for (size_t i = 0; i < history_.size(); i++)
+            if (history_[i]->id == id)
+                return history_[i];
+        return NULL;
+    }
+
+    /**
+     * Takes the keys of a staged transaction as one update. They stay
+     * a layer over the base shared with the transaction, so the next
+     * clone freezes only what the transaction changed.
+     */
+    void adopt(basic_setting *staged, const delta_writer &log)
+    {
+        if (journal_ != NULL)
+            write_journal(log);
+        map_.swap(staged->map_);
+        std::swap(hash_, staged->hash_);
+        cold_.swap(staged->cold_);
+        hot_.clear();
+        invalidate();
+        changed_ = true;
+        record();
+    }
+
+    /** Makes out hold the content of a kept version. */
+    static void restore(const version_entry &v, basic_setting *out)
+    {
+        out->map_.share(v.keys);
+        out->hash_ = v.hash;
+        out->cold_.share(v.cold);
+        out->hot_.clear();
+        out->invalidate();
+    }
+
+    /**
+     * Makes out hold the content of a kept version, first journaling
+     * the keys that differ if out has a journal.
+     */
+    static void restore_logged(const version_entry &v, basic_setting *out)
+    {
+        if (out->journal_ != NULL) {
+            basic_setting target;
+            restore(v, &target);
+            delta_writer w(out, &target);
+            item_type::diff(out->map_, target.map_, &w);
+            out->write_journal(w);
+        }
+        restore(v, out);
+    }
+
+    /**
+     * Hashes one key-value pair. Entries are combined by addition so
+     * that the sum does not depend on order and one entry can be taken
+     * out again by subtraction.
+     */
+    static uint64_t entry_hash(string_ref key, string_ref value)
+    {
+        uint64_t h = wire::hash_string(wire::hash_seed, key.data, key.size);
+        return wire::mix64(wire::hash_string(h, value.data, value.size));
+    }
+
+    /**
+     * Stores a raw value, keeping the fingerprints up to date.
+     *
+     * @param key    The Key.
+     * @param value  The raw value.
+     */
+    void assign(const std::string &key, const std::string &value)
+    {
+        uint64_t h = entry_hash(key, value);
+        string_ref old;
+
+        if (map_.find(key, &old)) {
+            hash_ -= entry_hash_of(key, old);
+            forget_cold(key);
+        }
+        map_.set(key, value);
+        hash_ += h;
+        changed_ = true;
+        invalidate();
+        if (cold_threshold_ > 0 && value.size() > cold_threshold_)
+            make_cold(key, value, h);
+    }
+
+    /**
+     * Appends a "key = value" line, quoting value if it has white-spaces
+     * around or starts with a quote. A value that spans lines or would
+     * be read back differently on one is written as a here-document.
+     */
+    static void append_item(std::string *out, string_ref key, string_ref value)
+    {
+        std::string tag("EOF");
+
+        out->append(key.data, key.size).append(" = ");
+        if (memchr(value.data, '\n', value.size) == NULL
+            && (value.empty() || value.data[value.size - 1] != '\\')
+            && !(value.size >= 2 && value.data[0] == '<'
+                 && value.data[1] == '<')) {
+            if (!value.empty() && (value.data[0] == '"'
+                                   || value.data[0] == '\''
+                                   || isspace(value.data[0] & 0xff)
+                                   || isspace(value.data[value.size - 1]
+                                              & 0xff)))
+                append_quoted(out, value);
+            else
+                out->append(value.data, value.size);
+            out->append("\n");
+            return;
+        }
+        while (has_line(value, tag))
+            tag.append("_");
+        out->append("<<").append(tag).append("\n");
+        out->append(value.data, value.size).append("\n");
+        out->append(tag).append("\n");
+    }
+
+    /** Tells whether a line of text reads as line, white-spaces aside. */
+    static bool has_line(string_ref text, const std::string &line)
+    {
+        const char *p = text.data, *end = text.data + text.size;
+
+        while (p <= end) {
+            const char *nl = static_cast<const char *>(
+                    memchr(p, '\n', end - p));
+            if (nl == NULL)
+                nl = end;
+            if (scanner::trim(string_ref(p, nl - p)) == string_ref(line))
+                return true;
+            p = nl + 1;
+        }
+        return false;
+    }
+
+    /**
+     * Appends value in double quotes, escaped so that scanner::unquote()
+     * gives it back.
+     */
+    static void append_quoted(std::string *out, string_ref value)
+    {
+        out->append(1, '"');
+        for (size_t i = 0; i < value.size; i++) {
+            char c = value.data[i];
+            if (c == '\\' && i + 1 < value.size
+                && (value.data[i + 1] == '$' || value.data[i + 1] == '\\'))
+                out->append(value.data + i++, 2);
+            else if (c == '\\')
+                out->append("\\\\");
+            else if (c == '"')
+                out->append("\\\"");
+            else if (c == '\t')
+                out->append("\\t");
+            else if (c == '\r')
+                out->append("\\r");
+            else
+                out->append(1, c);
+        }
+        out->append(1, '"');
+    }
+
+    /**
+     * Returns the raw value of an entry, decompressing it if it is cold.
+     * A decompressed value is valid until hot_slots_ other cold values
+     * have been read.
+     *
+     * @param key    The Key.
+     * @param raw    The value stored for key.
+     */
+    string_ref value_of(string_ref key, string_ref raw) const
+    {
+        cold_value cold;
+
+        if (!raw.empty() || !find_cold(key, &cold))
+            return raw;
+
+        size_t victim = 0;
+        tick_++;
+        for (size_t i = 0; i < hot_.size(); i++) {
+            if (string_ref(hot_[i].key) == key) {
+                hot_[i].used = tick_;
+                return hot_[i].value;
+            }
+            if (hot_[i].used < hot_[victim].used)
+                victim = i;
+        }
+        if (hot_.size() < hot_slots_) {
+            victim = hot_.size();
+            hot_.push_back(hot_value());
+        }
+        hot_[victim].key.assign(key.data, key.size);
+        hot_[victim].used = tick_;
+        decompress(cold, &hot_[victim].value);
+        return hot_[victim].value;
+    }
+
+    /** Returns entry_hash() of an entry without decompressing it. */
+    uint64_t entry_hash_of(string_ref key, string_ref raw) const
+    {
+        cold_value cold;
+
+        if (raw.empty() && find_cold(key, &cold))
+            return cold.hash;
+        return entry_hash(key, raw);
+    }
+
+    /** Finds the compressed value of key. */
+    bool find_cold(string_ref key, cold_value *out) const
+    {
+        string_ref stored;
+
+        if (cold_.size() == 0 || !cold_.find(key.str(), &stored))
+            return false;
+        wire::reader in(stored.data, stored.size);
+        out->size = in.get_u64();
+        out->hash = in.get_u64();
+        out->data = string_ref(stored.data + 16, stored.size - 16);
+        return true;
+    }
+
+    /**
+     * Moves the value of an entry into cold_ if it compresses.
+     *
+     * @param key    The Key.
+     * @param value  The raw value stored for key.
+     * @param hash   entry_hash() of the entry.
+     */
+    void make_cold(const std::string &key, string_ref value, uint64_t hash)
+    {
+#ifdef SETTING_HAVE_ZLIB
+        std::string data;
+        uLongf len = compressBound(value.size);
+
+        wire::put_u64(&data, value.size);
+        wire::put_u64(&data, hash);
+        data.resize(16 + len);
+        if (compress2(reinterpret_cast<Bytef *>(&data[16]), &len,
+                      reinterpret_cast<const Bytef *>(value.data),
+                      value.size, Z_DEFAULT_COMPRESSION) != Z_OK
+            || 16 + len >= value.size)
+            return;
+        // the storage copies only the used bytes, no compressBound() slack
+        cold_.set(key, string_ref(data.data(), 16 + len));
+        map_.set(key, string_ref());
+#else
+        (void)key; (void)value; (void)hash;
+#endif
+    }
+
+    /** Drops the compressed and decompressed copies of a key. */
+    void forget_cold(const std::string &key)
+    {
+        if (cold_.size() == 0 || !cold_.erase(key))
+            return;
+        for (size_t i = 0; i < hot_.size(); i++) {
+            if (hot_[i].key == key) {
+                hot_[i].key.clear();
+                hot_[i].value.clear();
+                hot_[i].used = 0;
+            }
+        }
+    }
+
+    static void decompress(const cold_value &cold, std::string *out)
+    {
+#ifdef SETTING_HAVE_ZLIB
+        uLongf len = cold.size;
+
+        out->resize(cold.size);
+        if (uncompress(reinterpret_cast<Bytef *>(&(*out)[0]), &len,
+                       reinterpret_cast<const Bytef *>(cold.data.data),
+                       cold.data.size) != Z_OK || len != cold.size)
+            throw std::runtime_error("corrupted compressed value.");
+#else
+        out->assign(cold.data.data, cold.data.size);
+#endif
+    }
+
+    /**
+     * Removes a key, keeping the fingerprints up to date.
+     *
+     * @param key    The Key.
+     * @return true if key existed.
+     */
+    bool remove(const std::string &key)
+    {
+        string_ref old;
+        if (!map_.find(key, &old))
+            return false;
+        hash_ -= entry_hash_of(key, old);
+        forget_cold(key);
+        map_.erase(key);
+        changed_ = true;
+        invalidate();
+        return true;
+    }
+
+    /**
+     * Finds the raw value of a key referred to by a value. Keys left out
+     * by a projection are looked up in its file on first use.
+     *
+     * @param key    The Key.
+     * @param raw    Set to the raw value if key exists.
+     * @return true if key exists.
+     */
+    bool find_reference(const std::string &key, string_ref *raw) const
+    {
+        if (map_.find(key, raw)) {
+            *raw = value_of(key, *raw);
+            return true;
+        }
+        if (sources_.empty())
+            return false;
+
+        typename std::map<std::string,
+                          std::pair<bool, std::string> >::iterator it;
+        it = outside_.find(key);
+        if (it == outside_.end()) {
+            projection only;
+            finder f;
+
+            only.add(key);
+            it = outside_.insert(std::make_pair(
+                    key, std::make_pair(false, std::string()))).first;
+            f.key = &key;
+            f.result = &it->second;
+            try {
+                for (size_t i = 0; i < sources_.size(); i++)
+                    if (!sources_[i].keys.match(key))
+                        scanner(&only).scan_file(
+                                sources_[i].filename.c_str(), &f);
+            } catch (...) {
+                outside_.erase(it);
+                throw;
+            }
+        }
+        *raw = it->second.second;
+        return it->second.first;
+    }
+
+    /**
+     * Parses a string, replacing each reference once. Escaped dollars
+     * and backslashes are kept for the next pass.
      *
      * @param     str   The string.
      * @param     out   Pointer to a std::string object used to hold the
      *                  output.
+     * @return    true if str held a reference.
      */
-    void parse_once(const std::string &str, std::string *out) const
+    bool parse_once(const std::string &str, std::string *out) const
     {
-        enum {
-            PS_UNKNOW = 0,
-            PS_ESCAPE,
-            PS_DOLLAR,
-            PS_FETCHKEY,
-            PS_REPLACE,
-            PS_FINISH,
-            PS_REPLACE_FINISH,
-        } state = PS_UNKNOW;
-
-        bool brace_open = false;
+        const char *pch = str.data(), *end = pch + str.size();
+        bool found = false;
         std::string key;
+        string_ref raw;
 
         out->clear();
-        for (const char *pch = str.c_str(); /* Forever */ ; pch++) {
-            if (*pch == '\\')
-                state = PS_ESCAPE;
-            else if (*pch == '\0')
-                state = (state == PS_FETCHKEY)?PS_REPLACE_FINISH:PS_FINISH;
-            else if (*pch == '$' && state != PS_ESCAPE)
-                state = PS_DOLLAR;
-            else if (state == PS_DOLLAR)
-                state = PS_FETCHKEY;
-            else if (state == PS_FETCHKEY &&
-                    !check_identifier(*pch) && *pch != '{')
-                state = PS_REPLACE;
-            else if (state != PS_FETCHKEY)
-                state = PS_UNKNOW;
-
-            if (state == PS_UNKNOW) {
-                out->append(pch, 1);
-            } else if (state == PS_FETCHKEY) {
-                if (check_identifier(*pch))
-                    key.append(pch, 1);
-                if (*pch == '{')
-                    brace_open = true;
-            } else if (state == PS_REPLACE || state == PS_REPLACE_FINISH) {
-                item_type::const_iterator found = map_.find(key);
-                if (found != map_.end()) {
-                    out->append(found->second);
-                    key.clear();
-                }
-                if (!(brace_open && *pch == '}'))
-                    pch--;
+        while (pch < end) {
+            if (*pch == '\\' && pch + 1 < end
+                && (pch[1] == '$' || pch[1] == '\\')) {
+                out->append(pch, 2);
+                pch += 2;
+                continue;
             }
-            if (state == PS_FINISH || state == PS_REPLACE_FINISH)
-                break;
+            if (*pch != '$') {
+                out->append(pch++, 1);
+                continue;
+            }
+            // $name, or ${name} whose name may hold dots
+            bool brace = (pch + 1 < end && pch[1] == '{');
+            const char *begin = pch + (brace ? 2 : 1), *p = begin;
+            while (p < end && (check_identifier(*p) || (brace && *p == '.')))
+                p++;
+            if (p == begin) {
+                out->append(pch, p - pch);
+                pch = p;
+                continue;
+            }
+            key.assign(begin, p - begin);
+            if (brace && p < end && *p == '}')
+                p++;
+            if (find_reference(key, &raw))
+                out->append(raw.data, raw.size);
+            found = true;
+            pch = p;
+        }
+        return found;
+    }
+
+    /** Drops the backslashes that escape a '$' or a backslash. */
+    static void unescape(const std::string &str, std::string *out)
+    {
+        out->clear();
+        for (size_t i = 0; i < str.size(); i++) {
+            if (str[i] == '\\' && i + 1 < str.size()
+                && (str[i + 1] == '$' || str[i + 1] == '\\'))
+                i++;
+            out->append(1, str[i]);
         }
     }
 
+    /** Tells whether str holds a '$' or an escaped backslash. */
+    static bool needs_parse(string_ref str)
+    {
+        const char *p = str.data, *end = str.data + str.size;
+
+        if (memchr(p, '$', str.size) != NULL)
+            return true;
+        while ((p = static_cast<const char *>(
+                        memchr(p, '\\', end - p))) != NULL)
+            if (++p < end && *p == '\\')
+                return true;
+        return false;
+    }
+
     /**
-     * Parses a string recursively.
+     * Parses a string recursively. Strings without a '$' or \\ are
+     * literal and copied as they are.
      *
      * @param    str   The string.
      * @param    out   Pointer to a std::string object used to hold the
      *                 outputs.
      */
-    void parse_recursive(const std::string &str, std::string *out) const
+    void parse_recursive(string_ref str, std::string *out) const
     {
-        std::string lhs(str), rhs;
+        if (!needs_parse(str)) {
+            out->assign(str.data, str.size);
+            return;
+        }
+
+        std::string lhs(str.data, str.size), rhs;
+        bool more = true;
 
-        for (size_t i = 0;
-             i < recursion_level_ && str.find('$') < str.npos;
-             i++) {
-            parse_once(lhs, &rhs);
-            lhs = rhs;
+        for (size_t i = 0; i < recursion_level_ && more; i++) {
+            more = parse_once(lhs, &rhs);
+            lhs.swap(rhs);
         }
-        *out = lhs;
+        unescape(lhs, out);
     }
 
   private:
-    DISALLOW_COPY_AND_ASSIGN(setting);
+    DISALLOW_COPY_AND_ASSIGN(basic_setting);
 };
 
+template <class Storage, class ThreadPolicy>
+const size_t basic_setting<Storage, ThreadPolicy>::npos;
+
+template <class Storage, class ThreadPolicy>
+const uint64_t basic_setting<Storage, ThreadPolicy>::unread;
+
+/** The setting with the default storage and no locking. */
+typedef basic_setting<> setting;
+
 /** @} */
 
 END_SETTING_NAMESPACE
@@ -0,0 +1,384 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef SETTING_CLIENT_H_
+#define SETTING_CLIENT_H_
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include "setting.h"
+#include "setting_notify.h"
+
+BEGIN_SETTING_NAMESPACE
+
+/** @addtogroup setting_api libsetting API
+ *
+ *  @{
+ */
+
+/**
+ * Client of setting_server with a local snapshot cache.
+ *
+ * The get_* calls are answered from the cached snapshot and never touch
+ * the socket. Call poll_updates() from time to time (or when fd()
+ * becomes readable) to pick up versions pushed by the server.
+ */
+class setting_client {
+  public:
+    /**
+     * Connects to a server, subscribes to notifications and fetches the
+     * first snapshot.
+     *
+     * @param path     Filesystem path of the server's Unix socket.
+     * @param level    Maximum recursion level of the cached setting.
+     */
+    explicit setting_client(const char *path, size_t level = 3)
+        :level_(level), version_(0), latest_(0), cache_(NULL),
+         notify_(NULL)
+    {
+        struct sockaddr_un addr;
+        std::string msg;
+
+        if (strlen(path) >= sizeof(addr.sun_path))
+            throw std::runtime_error(
+                    std::string("socket path too long ") +
+                    std::string(path) + std::string("."));
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+
+        fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd_ < 0
+            || connect(fd_, reinterpret_cast<struct sockaddr *>(&addr),
+                       sizeof(addr)) < 0) {
+            std::string err(strerror(errno));
+            if (fd_ >= 0)
+                close(fd_);
+            throw std::runtime_error(
+                    std::string("can not connect to ") + std::string(path) +
+                    std::string(": ") + err + std::string("."));
+        }
+
+        try {
+            wire::end_frame(&msg, wire::begin_frame(&msg,
+                                                    wire::OP_SUBSCRIBE));
+            send_all(msg);
+            refresh();
+        } catch (...) {
+            close(fd_);
+            delete cache_;
+            throw;
+        }
+    }
+
+    ~setting_client()
+    {
+        close(fd_);
+        delete cache_;
+        delete notify_;
+    }
+
+    /** Returns the version of the cached snapshot. */
+    uint32_t version() const { return version_; }
+
+    /** Returns the cached snapshot. */
+    const setting& cache() const { return *cache_; }
+
+    /** Returns the socket, for use in an external event loop. */
+    int fd() const { return fd_; }
+
+    /**
+     * Follows the generation_counter the server keeps in path, see
+     * setting_server::notify_through(). poll_updates() then learns of
+     * new versions from shared memory: checking costs no system call
+     * and waiting blocks on the counter.
+     *
+     * @param path  The file of the counter.
+     */
+    void watch(const char *path)
+    {
+        generation_counter *counter = new generation_counter(path);
+        delete notify_;
+        notify_ = counter;
+    }
+
+    /**
+     * Processes pending notifications and refreshes the cache if the
+     * server has published a newer version.
+     *
+     * @param timeout_ms Time to wait for a notification, 0 to only
+     *                   check.
+     * @return true if the cache was refreshed.
+     */
+    bool poll_updates(int timeout_ms = 0)
+    {
+        struct pollfd pfd;
+        char buf[4096];
+        ssize_t n;
+
+        if (notify_ != NULL && latest_ == version_) {
+            if (!notify_->wait(version_, timeout_ms))
+                return false;
+            if (latest_ < notify_->current())
+                latest_ = notify_->current();
+        }
+        pfd.fd = fd_;
+        pfd.events = POLLIN;
+        if (latest_ == version_ && poll(&pfd, 1, timeout_ms) > 0) {
+            while ((n = recv(fd_, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+                in_.append(buf, n);
+            if (n == 0)
+                throw std::runtime_error("server closed connection.");
+            drain(0, NULL);
+        }
+        if (latest_ != version_) {
+            update();
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * Brings the cache up to date with the server. When the cache is one
+     * version behind, only the delta between the two versions is
+     * transferred and applied in place; otherwise a full snapshot is.
+     */
+    void update()
+    {
+        std::string msg, body;
+        size_t start;
+
+        start = wire::begin_frame(&msg, wire::OP_DELTA);
+        wire::put_u32(&msg, version_);
+        wire::end_frame(&msg, start);
+        send_all(msg);
+        wait_for(wire::OP_DELTA_DATA, &body);
+
+        wire::reader in(body.data(), body.size());
+        uint32_t version = in.get_u32();
+        if (in.get_u8() == 0) {
+            replace(version, body.data() + 5, body.size() - 5);
+            return;
+        }
+        try {
+            cache_->apply_delta(body.data() + 5, body.size() - 5);
+        } catch (const std::runtime_error &) {
+            // the cache no longer matches the base, start over
+            refresh();
+            return;
+        }
+        version_ = version;
+        if (latest_ < version)
+            latest_ = version;
+    }
+
+    /** Fetches a full snapshot from the server and replaces the cache. */
+    void refresh()
+    {
+        std::string msg, body;
+
+        wire::end_frame(&msg, wire::begin_frame(&msg, wire::OP_SNAPSHOT));
+        send_all(msg);
+        wait_for(wire::OP_SNAPSHOT_DATA, &body);
+
+        replace(wire::reader(body.data(), body.size()).get_u32(),
+                body.data() + 4, body.size() - 4);
+    }
+
+    /**
+     * Asks the server to resolve a key. This always goes over the
+     * socket; prefer the cached get_* calls on hot paths.
+     *
+     * @param   key   The Key.
+     * @param   out   Pointer to a std::string object to hold the value.
+     * @return true if key exists, otherwise false.
+     */
+    bool lookup(const std::string &key, std::string *out)
+    {
+        std::string msg, body;
+        size_t start;
+
+        start = wire::begin_frame(&msg, wire::OP_GET);
+        wire::put_string(&msg, key);
+        wire::end_frame(&msg, start);
+        send_all(msg);
+        wait_for(wire::OP_VALUE, &body);
+
+        wire::reader in(body.data(), body.size());
+        bool found = in.get_u8() != 0;
+        in.get_string(out);
+        return found;
+    }
+
+    /** @see setting::get_int */
+    int get_int(const std::string &key, int defval = 0) const
+    {
+        return cache_->get_int(key, defval);
+    }
+
+    /** @see setting::get_long */
+    long get_long(const std::string &key, long defval = 0) const
+    {
+        return cache_->get_long(key, defval);
+    }
+
+    /** @see setting::get_longlong */
+    long get_longlong(const std::string &key, long long defval = 0) const
+    {
+        return cache_->get_longlong(key, defval);
+    }
+
+    /** @see setting::get_double */
+    long get_double(const std::string &key, double defval = 0.0) const
+    {
+        return cache_->get_double(key, defval);
+    }
+
+    /** @see setting::get_cstr */
+    const char* get_cstr(const std::string &key,
+                         const char *defval = NULL) const
+    {
+        return cache_->get_cstr(key, defval);
+    }
+
+    /** @see setting::get_vector */
+    bool get_vector(const std::string &key, std::vector<std::string> *out)
+    {
+        return cache_->get_vector(key, out);
+    }
+
+  private:
+    /** Replaces the cache with a snapshot of the given version. */
+    void replace(uint32_t version, const char *data, size_t size)
+    {
+        setting *fresh = new setting(level_);
+        try {
+            fresh->deserialize(data, size);
+        } catch (...) {
+            delete fresh;
+            throw;
+        }
+        delete cache_;
+        cache_ = fresh;
+        version_ = version;
+        if (latest_ < version)
+            latest_ = version;
+    }
+
+    void send_all(const std::string &msg)
+    {
+        size_t off = 0;
+        ssize_t n;
+
+        while (off < msg.size()) {
+            n = send(fd_, msg.data() + off, msg.size() - off, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                throw std::runtime_error(
+                        std::string("can not send to server: ") +
+                        std::string(strerror(errno)) + std::string("."));
+            off += n;
+        }
+    }
+
+    /**
+     * Handles buffered frames until one with opcode want is found.
+     *
+     * @return true if such a frame was found and stored in body.
+     */
+    bool drain(uint8_t want, std::string *body)
+    {
+        uint8_t op;
+        std::string frame;
+
+        while (wire::take_frame(&in_, &op, &frame)) {
+            if (op == wire::OP_NOTIFY) {
+                uint32_t v = wire::reader(frame.data(), frame.size())
+                             .get_u32();
+                if (latest_ < v)
+                    latest_ = v;
+            } else if (op == wire::OP_ERROR) {
+                std::string err;
+                wire::reader(frame.data(), frame.size()).get_string(&err);
+                throw std::runtime_error(err);
+            } else if (op == want) {
+                body->swap(frame);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /** Blocks until a frame with opcode want arrives. */
+    void wait_for(uint8_t want, std::string *body)
+    {
+        char buf[65536];
+        ssize_t n;
+
+        while (!drain(want, body)) {
+            n = recv(fd_, buf, sizeof(buf), 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                throw std::runtime_error("server closed connection.");
+            in_.append(buf, n);
+        }
+    }
+
+    size_t level_;
+    int fd_;
+    /** Version of cache_. */
+    uint32_t version_;
+    /** Newest version announced by the server. */
+    uint32_t latest_;
+    setting *cache_;
+    /** Counter of the server's version, see watch(). */
+    generation_counter *notify_;
+    std::string in_;
+
+    DISALLOW_COPY_AND_ASSIGN(setting_client);
+};
+
+/** @} */
+
+END_SETTING_NAMESPACE
+
+#endif  // SETTING_CLIENT_H_
+
+// vim: ts=4 sw=4 et ai cindent
@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef SETTING_NOTIFY_H_
+#define SETTING_NOTIFY_H_
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include <string>
+#include <stdexcept>
+
+#ifndef BEGIN_SETTING_NAMESPACE
+#define BEGIN_SETTING_NAMESPACE namespace dutil {
+#define END_SETTING_NAMESPACE }
+#endif
+
+BEGIN_SETTING_NAMESPACE
+
+/** @addtogroup setting_api libsetting API
+ *
+ *  @{
+ */
+
+/**
+ * A version number shared by processes through a small file, typically
+ * in /dev/shm, so readers learn of a new configuration without asking
+ * its publisher.
+ *
+ * Reading the number is a load from shared memory. Waiting for it to
+ * change blocks on a futex, which publish() wakes, so waiters resume
+ * within microseconds. Systems without futexes wait by polling every
+ * millisecond.
+ */
+class generation_counter {
+  public:
+    /**
+     * Maps the counter kept in path, creating it at 0 if needed.
+     *
+     * @param path  The file.
+     */
+    explicit generation_counter(const char *path)
+    {
+        struct stat st;
+        int fd = open(path, O_RDWR | O_CREAT, 0644);
+        void *p = MAP_FAILED;
+
+        if (fd >= 0) {
+            if (fstat(fd, &st) == 0
+                && (st.st_size >= static_cast<off_t>(sizeof(uint32_t))
+                    || ftruncate(fd, sizeof(uint32_t)) == 0))
+                p = mmap(NULL, sizeof(uint32_t), PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+            close(fd);
+        }
+        if (p == MAP_FAILED)
+            throw std::runtime_error(
+                    std::string("can not map generation counter ") +
+                    std::string(path) + std::string("."));
+        word_ = static_cast<uint32_t *>(p);
+    }
+
+    ~generation_counter()
+    {
+        munmap(word_, sizeof(uint32_t));
+    }
+
+    /** Returns the current generation. */
+    uint32_t current() const
+    {
+        return __atomic_load_n(word_, __ATOMIC_ACQUIRE);
+    }
+
+    /**
+     * Sets the generation and wakes every waiter.
+     *
+     * @param generation  The new generation.
+     */
+    void publish(uint32_t generation)
+    {
+        __atomic_store_n(word_, generation, __ATOMIC_RELEASE);
+#ifdef __linux__
+        syscall(SYS_futex, word_, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+    }
+
+    /**
+     * Waits until the generation differs from seen.
+     *
+     * @param seen        The generation the caller has.
+     * @param timeout_ms  Time to wait, 0 to only check, -1 for ever.
+     * @return true if the generation differs from seen.
+     */
+    bool wait(uint32_t seen, int timeout_ms = -1) const
+    {
+        struct timespec deadline, left;
+
+        if (timeout_ms >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += timeout_ms / 1000;
+            deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+        }
+        while (current() == seen) {
+            if (timeout_ms >= 0 && !remaining(deadline, &left))
+                return false;
+#ifdef __linux__
+            syscall(SYS_futex, word_, FUTEX_WAIT, seen,
+                    (timeout_ms >= 0) ? &left : NULL, NULL, 0);
+#else
+            usleep(1000);
+#endif
+        }
+        return true;
+    }
+
+  private:
+    /** Computes the time left until deadline, false if none is. */
+    static bool remaining(const struct timespec &deadline,
+                          struct timespec *left)
+    {
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left->tv_sec = deadline.tv_sec - now.tv_sec;
+        left->tv_nsec = deadline.tv_nsec - now.tv_nsec;
+        if (left->tv_nsec < 0) {
+            left->tv_sec--;
+            left->tv_nsec += 1000000000L;
+        }
+        return left->tv_sec >= 0
+               && (left->tv_sec > 0 || left->tv_nsec > 0);
+    }
+
+    uint32_t *word_;
+
+    generation_counter(const generation_counter&);
+    void operator=(const generation_counter&);
+};
+
+/** @} */
+
+END_SETTING_NAMESPACE
+
+#endif  // SETTING_NOTIFY_H_
+
+// vim: ts=4 sw=4 et ai cindent
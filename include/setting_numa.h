@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef SETTING_NUMA_H_
+#define SETTING_NUMA_H_
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef SETTING_HAVE_NUMA
+#include <numa.h>
+#endif
+
+#include <string>
+#include <stdexcept>
+#include <vector>
+
+#include "setting.h"
+
+BEGIN_SETTING_NAMESPACE
+
+/** @addtogroup setting_api libsetting API
+ *
+ *  @{
+ */
+
+/**
+ * One copy of a setting per NUMA node, so that readers never fetch
+ * configuration from the memory of another socket.
+ *
+ * The nodes are detected at runtime, through libnuma when built with
+ * SETTING_HAVE_NUMA (link with -lnuma) and from /sys otherwise. Each
+ * replica is built by a thread running on its node, so its memory is
+ * allocated there (bound with libnuma, by first touch otherwise).
+ * Machines with one node, or where nothing can be detected, keep a
+ * single replica.
+ *
+ * @tparam Setting  The replicated setting. Its thread policy must be
+ *                  multi_threaded if publish() runs while other threads
+ *                  read.
+ */
+template <class Setting = basic_setting<SETTING_STORAGE, multi_threaded> >
+class numa_replicas {
+  public:
+    /**
+     * Detects the nodes and makes an empty replica on each.
+     *
+     * @param level    Maximum recursion level of the replicas.
+     */
+    explicit numa_replicas(size_t level = 3)
+        :level_(level)
+    {
+        detect();
+        for (size_t i = 0; i < nodes_.size(); i++)
+            replicas_.push_back(new Setting(level_));
+    }
+
+    ~numa_replicas()
+    {
+        for (size_t i = 0; i < replicas_.size(); i++)
+            delete replicas_[i];
+    }
+
+    /** Returns the number of replicas, one per node. */
+    size_t size() const
+    {
+        return replicas_.size();
+    }
+
+    /** Returns the replica of the node the calling thread runs on. */
+    const Setting& local() const
+    {
+        int cpu = sched_getcpu();
+        if (cpu < 0 || static_cast<size_t>(cpu) >= cpu_replica_.size())
+            return *replicas_[0];
+        return *replicas_[cpu_replica_[cpu]];
+    }
+
+    /** Returns the replica of the i-th node. */
+    const Setting& replica(size_t i) const
+    {
+        return *replicas_[i];
+    }
+
+    /**
+     * Copies a setting into every replica. All replicas are built on
+     * their nodes before the first one changes, then each takes its
+     * copy by a constant-time swap, so readers on different nodes see
+     * the new content within microseconds of each other.
+     *
+     * @param source  The setting to copy.
+     */
+    void publish(const Setting &source)
+    {
+        std::vector<builder> builders(replicas_.size());
+        std::string snapshot;
+        std::string error;
+
+        source.serialize(&snapshot);
+        for (size_t i = 0; i < builders.size(); i++) {
+            builders[i].owner = this;
+            builders[i].node = i;
+            builders[i].snapshot = &snapshot;
+            builders[i].fresh = NULL;
+            builders[i].started = pthread_create(&builders[i].thread, NULL,
+                                                 &build, &builders[i]) == 0;
+            if (!builders[i].started)
+                build(&builders[i]);
+        }
+        for (size_t i = 0; i < builders.size(); i++) {
+            if (builders[i].started)
+                pthread_join(builders[i].thread, NULL);
+            if (builders[i].fresh == NULL && error.empty())
+                error = builders[i].error;
+        }
+        if (!error.empty()) {
+            for (size_t i = 0; i < builders.size(); i++)
+                delete builders[i].fresh;
+            throw std::runtime_error(error);
+        }
+        for (size_t i = 0; i < builders.size(); i++) {
+            replicas_[i]->swap(*builders[i].fresh);
+            delete builders[i].fresh;
+        }
+    }
+
+  private:
+    /** Builds the replica of one node. */
+    struct builder {
+        numa_replicas *owner;
+        size_t node;
+        const std::string *snapshot;
+        Setting *fresh;
+        std::string error;
+        pthread_t thread;
+        bool started;
+    };
+
+    static void *build(void *arg)
+    {
+        builder *b = static_cast<builder *>(arg);
+        Setting *fresh = NULL;
+
+        try {
+            b->owner->bind(b->node);
+            fresh = new Setting(b->owner->level_);
+            fresh->deserialize(b->snapshot->data(), b->snapshot->size());
+            b->fresh = fresh;
+        } catch (const std::exception &e) {
+            delete fresh;
+            b->error = e.what();
+        }
+        return NULL;
+    }
+
+    /** Moves the calling thread and its allocations to a node. */
+    void bind(size_t i) const
+    {
+        if (nodes_.size() < 2)
+            return;
+#ifdef SETTING_HAVE_NUMA
+        numa_run_on_node(nodes_[i]);
+        numa_set_preferred(nodes_[i]);
+#else
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (size_t cpu = 0; cpu < cpu_replica_.size(); cpu++)
+            if (cpu_replica_[cpu] == i && cpu < CPU_SETSIZE)
+                CPU_SET(cpu, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+#endif
+    }
+
+    /** Fills nodes_ and cpu_replica_. */
+    void detect()
+    {
+#ifdef SETTING_HAVE_NUMA
+        if (numa_available() >= 0) {
+            for (int node = 0; node <= numa_max_node(); node++)
+                if (numa_bitmask_isbitset(numa_all_nodes_ptr, node))
+                    nodes_.push_back(node);
+            for (int cpu = 0; cpu < numa_num_configured_cpus(); cpu++)
+                cpu_replica_.push_back(index_of(numa_node_of_cpu(cpu)));
+        }
+#else
+        std::vector<int> cpus;
+        char path[64];
+
+        read_list("/sys/devices/system/node/online", &nodes_);
+        for (size_t i = 0; i < nodes_.size(); i++) {
+            snprintf(path, sizeof(path),
+                     "/sys/devices/system/node/node%d/cpulist", nodes_[i]);
+            cpus.clear();
+            read_list(path, &cpus);
+            for (size_t c = 0; c < cpus.size(); c++) {
+                if (static_cast<size_t>(cpus[c]) >= cpu_replica_.size())
+                    cpu_replica_.resize(cpus[c] + 1, 0);
+                cpu_replica_[cpus[c]] = i;
+            }
+        }
+#endif
+        if (nodes_.empty()) {
+            nodes_.push_back(0);
+            cpu_replica_.clear();
+        }
+    }
+
+    /** Returns the replica of a node, 0 if it is unknown. */
+    size_t index_of(int node) const
+    {
+        for (size_t i = 0; i < nodes_.size(); i++)
+            if (nodes_[i] == node)
+                return i;
+        return 0;
+    }
+
+    /** Reads a list like "0-3,8,10-11" from a file, if it exists. */
+    static void read_list(const char *path, std::vector<int> *out)
+    {
+        FILE *fp = fopen(path, "r");
+        char buf[4096];
+        char *p;
+
+        if (fp == NULL)
+            return;
+        p = fgets(buf, sizeof(buf), fp);
+        fclose(fp);
+        while (p != NULL && *p >= '0' && *p <= '9') {
+            long first = strtol(p, &p, 10), last = first;
+            if (*p == '-')
+                last = strtol(p + 1, &p, 10);
+            for (long n = first; n <= last; n++)
+                out->push_back(static_cast<int>(n));
+            p = (*p == ',') ? p + 1 : NULL;
+        }
+    }
+
+    size_t level_;
+    /** Node numbers, one per replica. */
+    std::vector<int> nodes_;
+    /** Replica of each CPU. */
+    std::vector<size_t> cpu_replica_;
+    std::vector<Setting *> replicas_;
+
+    DISALLOW_COPY_AND_ASSIGN(numa_replicas);
+};
+
+/** @} */
+
+END_SETTING_NAMESPACE
+
+#endif  // SETTING_NUMA_H_
+
+// vim: ts=4 sw=4 et ai cindent
@@ -0,0 +1,723 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef SETTING_SCAN_H_
+#define SETTING_SCAN_H_
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef SETTING_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef SETTING_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <string>
+#include <stdexcept>
+#include <vector>
+
+#include "setting_storage.h"
+
+BEGIN_SETTING_NAMESPACE
+
+/** @addtogroup setting_api libsetting API
+ *
+ *  @{
+ */
+
+/**
+ * A set of key prefixes to load. An empty prefix matches every key.
+ *
+ * @code
+ * projection keys;
+ * keys.add("db.");
+ * keys.add("log.level");
+ * @endcode
+ */
+class projection {
+  public:
+    projection(): any_(false)
+    {
+        memset(first_, 0, sizeof(first_));
+    }
+
+    /** Adds a prefix. */
+    void add(const std::string &prefix)
+    {
+        if (prefix.empty())
+            any_ = true;
+        else
+            first_[static_cast<unsigned char>(prefix[0])] = true;
+        prefixes_.push_back(prefix);
+    }
+
+    /** Returns true if key starts with one of the prefixes. */
+    bool match(string_ref key) const
+    {
+        return any_ || (key.size > 0 && match_prefix(key.data, key.size));
+    }
+
+    /**
+     * Returns true if the text of a line, starting at its key, may
+     * hold a matching key. Used to skip lines before they are trimmed
+     * and split.
+     */
+    bool match_prefix(const char *data, size_t size) const
+    {
+        if (any_)
+            return true;
+        if (size == 0 || !first_[static_cast<unsigned char>(data[0])])
+            return false;
+        for (size_t i = 0; i < prefixes_.size(); i++) {
+            const std::string &p = prefixes_[i];
+            if (p.size() <= size && memcmp(p.data(), data, p.size()) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    const std::vector<std::string> &prefixes() const
+    {
+        return prefixes_;
+    }
+
+  private:
+    std::vector<std::string> prefixes_;
+    /** Whether some prefix starts with a byte. */
+    bool first_[256];
+    /** Whether some prefix is empty. */
+    bool any_;
+};
+
+/**
+ * Streaming tokenizer of configuration text.
+ *
+ * Text is fed in chunks of any size; every complete item line is handed
+ * to a handler as
+ *
+ * @code
+ * void item(string_ref key, string_ref value, size_t line);
+ * @endcode
+ *
+ * where line counts from 1 and the references are valid only during
+ * the call. Comments and blank lines are skipped. Lines that lie inside
+ * one chunk are tokenized in place; only a line split between chunks is
+ * copied, so memory use does not grow with the input. setting loads
+ * files through the same scanner.
+ *
+ * A line "[name]" starts a section: the keys that follow are reported
+ * as name.key until the next section, and "[]" returns to the top
+ * level. Dotted names nest, so [core.db] holds core.db.host.
+ *
+ * A value may span several lines in two ways. A line ending with a
+ * backslash continues on the next one, whose leading white-spaces are
+ * dropped. A value "<<TAG" starts a here-document: the lines up to one
+ * that holds only TAG form the value, joined by newlines and kept
+ * verbatim. A here-document that lies inside one chunk is handed over
+ * as a reference into the chunk instead of being copied line by line.
+ *
+ * A scanner given a projection skips the lines whose key does not
+ * match it before trimming or splitting them.
+ */
+class scanner {
+  public:
+    /** Bytes read or decompressed at a time by scan_file(). */
+    static const size_t chunk_size = 65536;
+
+    /**
+     * Constructs a scanner.
+     *
+     * @param keys  If not NULL, only items whose key matches it are
+     *              handed to the handler. It must outlive the scanner.
+     */
+    explicit scanner(const projection *keys = NULL)
+        :line_(0), keys_(keys), joining_(false), joined_line_(0),
+         here_line_(0), here_keep_(false), body_lines_(0),
+         spanning_(false), begin_(NULL), end_(NULL) {}
+
+    /**
+     * Feeds a chunk of text.
+     *
+     * @param data   The chunk.
+     * @param size   Size of the chunk in bytes.
+     * @param h      The handler.
+     */
+    template <class Handler>
+    void feed(const char *data, size_t size, Handler *h)
+    {
+        const char *end = data + size;
+        const char *nl;
+
+        while ((nl = static_cast<const char *>(
+                        memchr(data, '\n', end - data))) != NULL) {
+            if (carry_.empty()) {
+                line(string_ref(data, nl - data), true, h);
+            } else {
+                carry_.append(data, nl - data);
+                line(carry_, false, h);
+                carry_.clear();
+            }
+            data = nl + 1;
+        }
+        carry_.append(data, end - data);
+        // the chunk goes away, so a body read from it so far is copied
+        if (spanning_ && body_lines_ > 0) {
+            body_.assign(begin_, end_ - begin_);
+            spanning_ = false;
+        }
+    }
+
+    /**
+     * Handles a last line without a newline.
+     *
+     * @throw std::runtime_error if a here-document is not terminated.
+     */
+    template <class Handler>
+    void finish(Handler *h)
+    {
+        if (!carry_.empty()) {
+            line(carry_, false, h);
+            carry_.clear();
+        }
+        if (joining_) {
+            joining_ = false;
+            item(joined_, joined_line_, h);
+        }
+        if (!tag_.empty()) {
+            tag_.clear();
+            throw std::runtime_error(
+                    std::string("unterminated here-document ") +
+                    here_key_ + std::string("."));
+        }
+    }
+
+    /**
+     * Scans a configuration file. gzip and zstd compressed files are
+     * detected by their magic number and decompressed on the fly in
+     * chunk_size pieces. This requires building with SETTING_HAVE_ZLIB
+     * (link with -lz) or SETTING_HAVE_ZSTD (link with -lzstd)
+     * respectively.
+     *
+     * @param filename Filename of the configuration.
+     * @param h        The handler.
+     */
+    template <class Handler>
+    void scan_file(const char *filename, Handler *h)
+    {
+        FILE *fp = fopen(filename, "rb");
+        if (fp == NULL)
+            throw std::runtime_error(
+                    std::string("can not open configuration file ") +
+                    std::string(filename) + std::string("."));
+
+        std::vector<char> in(chunk_size);
+        size_t n = fread(&in[0], 1, in.size(), fp);
+        const unsigned char *magic = reinterpret_cast<unsigned char *>(&in[0]);
+
+        try {
+            if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+                read_gzip(fp, filename, &in, n, h);
+            else if (n >= 4 && magic[0] == 0x28 && magic[1] == 0xb5
+                     && magic[2] == 0x2f && magic[3] == 0xfd)
+                read_zstd(fp, filename, &in, n, h);
+            else
+                for (; n > 0; n = fread(&in[0], 1, in.size(), fp))
+                    feed(&in[0], n, h);
+        } catch (...) {
+            fclose(fp);
+            throw;
+        }
+        fclose(fp);
+        finish(h);
+    }
+
+    /** Trims white-spaces around s. */
+    static string_ref trim(string_ref s)
+    {
+        size_t begin = 0, end = s.size;
+
+        while (begin < s.size && is_space(s.data[begin]))
+            begin++;
+        while (end > begin && is_space(s.data[end - 1]))
+            end--;
+        return string_ref(s.data + begin, end - begin);
+    }
+
+    /**
+     * Decodes a quoted value into the form setting stores.
+     *
+     * A value in double quotes may hold the escapes \n, \t, \r, \",
+     * \\ and \$, the last staying escaped for the expander; $key
+     * references in it are kept. A value in single quotes is taken
+     * literally, references included. Any other value, or one with text
+     * after its closing quote, is returned as it is.
+     *
+     * In the stored form a '$' starts a reference unless escaped as \$,
+     * \\ stands for one backslash and any other backslash for itself,
+     * so values holding neither a '$' nor \\ need no expansion.
+     *
+     * @param value  The trimmed value.
+     * @param buf    Holds the result if value was quoted.
+     * @return The stored value, in value or buf.
+     */
+    static string_ref unquote(string_ref value, std::string *buf)
+    {
+        if (value.size < 2 || (value.data[0] != '"' && value.data[0] != '\''))
+            return value;
+        char quote = value.data[0];
+        const char *p = value.data + 1, *end = value.data + value.size - 1;
+        const char *q = p;
+        // the closing quote must end the value
+        while (q < end && *q != quote)
+            q += (quote == '"' && *q == '\\') ? 2 : 1;
+        if (q != end || *end != quote)
+            return value;
+
+        buf->clear();
+        for (; p < end; p++) {
+            if (quote == '\'' || *p != '\\') {
+                if (*p == '\\')
+                    buf->append("\\\\");
+                else if (*p == '$' && quote == '\'')
+                    buf->append("\\$");
+                else
+                    buf->append(1, *p);
+                continue;
+            }
+            switch (*++p) {
+            case 'n':  buf->append(1, '\n'); break;
+            case 't':  buf->append(1, '\t'); break;
+            case 'r':  buf->append(1, '\r'); break;
+            case '"':  buf->append(1, '"'); break;
+            case '$':  buf->append("\\$"); break;
+            case '\\': buf->append("\\\\"); break;
+            default:   buf->append(1, '\\').append(1, *p); break;
+            }
+        }
+        return *buf;
+    }
+
+    /**
+     * Splits an item line into its trimmed key and value. A line
+     * without '=' is both key and value.
+     */
+    static void split(string_ref s, string_ref *key, string_ref *value)
+    {
+        const char *eq = static_cast<const char *>(memchr(s.data, '=', s.size));
+
+        if (eq == NULL) {
+            *key = *value = trim(s);
+            return;
+        }
+        *key = trim(string_ref(s.data, eq - s.data));
+        *value = trim(string_ref(eq + 1, s.data + s.size - eq - 1));
+    }
+
+  private:
+    static bool is_space(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+
+    /** Tells whether c can not end a continued line. */
+    static bool is_word(char c)
+    {
+        return isalnum(c & 0xff) != 0;
+    }
+
+    static string_ref skip_space(string_ref s)
+    {
+        while (s.size > 0 && is_space(s.data[0])) {
+            s.data++;
+            s.size--;
+        }
+        return s;
+    }
+
+    /**
+     * Tells whether s ends with a backslash, white-spaces aside, and
+     * sets *head to what comes before it.
+     */
+    static bool continued(string_ref s, string_ref *head)
+    {
+        size_t end = s.size;
+
+        while (end > 0 && is_space(s.data[end - 1]))
+            end--;
+        if (end == 0 || s.data[end - 1] != '\\')
+            return false;
+        *head = string_ref(s.data, end - 1);
+        return true;
+    }
+
+    /** Tells whether value is "<<TAG" and sets *tag. */
+    static bool here_tag(string_ref value, string_ref *tag)
+    {
+        size_t end = 2;
+
+        if (value.size < 3 || value.data[0] != '<' || value.data[1] != '<')
+            return false;
+        while (end < value.size && (isalnum(value.data[end] & 0xff)
+                                    || value.data[end] == '_'))
+            end++;
+        if (end == 2 || !skip_space(string_ref(value.data + end,
+                                               value.size - end)).empty())
+            return false;
+        *tag = string_ref(value.data + 2, end - 2);
+        return true;
+    }
+
+    /**
+     * Handles one line.
+     *
+     * @param in_chunk  Whether s lies in the chunk being fed rather than
+     *                  in carry_.
+     */
+    template <class Handler>
+    void line(string_ref s, bool in_chunk, Handler *h)
+    {
+        string_ref head;
+
+        line_++;
+        if (!tag_.empty()) {
+            body_line(s, in_chunk, h);
+            return;
+        }
+        if (joining_) {
+            s = skip_space(s);
+            if (continued(s, &head)) {
+                joined_.append(head.data, head.size);
+                return;
+            }
+            joined_.append(s.data, s.size);
+            joining_ = false;
+            item(joined_, joined_line_, h);
+            return;
+        }
+        if (keys_ != NULL && section_.empty()) {
+            string_ref rest = skip_space(s);
+            if (!rest.empty() && rest.data[0] != '['
+                && !keys_->match_prefix(rest.data, rest.size)
+                && memchr(rest.data, '<', rest.size) == NULL
+                && !continued(rest, &head))
+                return;
+        }
+        s = trim(s);
+        if (s.empty() || s.data[0] == '#')
+            return;
+        if (s.data[0] == '[' && header(s))
+            return;
+        if (!is_word(s.data[s.size - 1]) && continued(s, &head)) {
+            joined_.assign(head.data, head.size);
+            joined_line_ = line_;
+            joining_ = true;
+            return;
+        }
+        item(s, line_, h);
+    }
+
+    /** Hands over the item on line s, or starts its here-document. */
+    template <class Handler>
+    void item(string_ref s, size_t at, Handler *h)
+    {
+        string_ref key, value, tag;
+
+        split(s, &key, &value);
+        if (key.empty())
+            return;
+        if (!section_.empty()) {
+            key_.assign(section_).append(1, '.').append(key.data, key.size);
+            key = key_;
+        }
+        bool keep = keys_ == NULL || keys_->match(key);
+        if (value.data != key.data && here_tag(value, &tag)) {
+            tag_.assign(tag.data, tag.size);
+            here_key_.assign(key.data, key.size);
+            here_line_ = at;
+            here_keep_ = keep;
+            body_lines_ = 0;
+            body_.clear();
+            spanning_ = true;
+            return;
+        }
+        if (keep)
+            h->item(key, unquote(value, &value_), at);
+    }
+
+    /** Adds a line to the open here-document, or closes it. */
+    template <class Handler>
+    void body_line(string_ref s, bool in_chunk, Handler *h)
+    {
+        if (s.size > 0 && s.data[s.size - 1] == '\r')
+            s.size--;
+        string_ref rest = skip_space(s);
+        if (rest.size >= tag_.size()
+            && memcmp(rest.data, tag_.data(), tag_.size()) == 0
+            && skip_space(string_ref(rest.data + tag_.size(),
+                                     rest.size - tag_.size())).empty()) {
+            string_ref value;
+            if (body_lines_ > 0)
+                value = spanning_ ? string_ref(begin_, end_ - begin_)
+                                  : string_ref(body_);
+            tag_.clear();
+            if (here_keep_)
+                h->item(here_key_, value, here_line_);
+            return;
+        }
+        if (!here_keep_) {
+            body_lines_++;
+            return;
+        }
+        // consecutive lines of the chunk stay one reference into it
+        if (spanning_ && in_chunk
+            && (body_lines_ == 0 || s.data == end_ + 1)) {
+            if (body_lines_ == 0)
+                begin_ = s.data;
+            end_ = s.data + s.size;
+        } else {
+            if (spanning_ && body_lines_ > 0)
+                body_.assign(begin_, end_ - begin_);
+            spanning_ = false;
+            if (body_lines_ > 0)
+                body_.append(1, '\n');
+            body_.append(s.data, s.size);
+        }
+        body_lines_++;
+    }
+
+    /**
+     * Enters the section named by a "[name]" line.
+     *
+     * @return false if s is not a section header.
+     */
+    bool header(string_ref s)
+    {
+        const char *close = static_cast<const char *>(
+                memchr(s.data, ']', s.size));
+        if (close == NULL)
+            return false;
+        const char *begin = s.data + 1;
+        while (begin < close && is_space(*begin))
+            begin++;
+        while (close > begin && is_space(close[-1]))
+            close--;
+        section_.assign(begin, close - begin);
+        return true;
+    }
+
+    /**
+     * Decompresses a gzip stream whose first n bytes are already in
+     * in, feeding the text chunk by chunk.
+     */
+    template <class Handler>
+    void read_gzip(FILE *fp, const char *filename, std::vector<char> *in,
+                   size_t n, Handler *h)
+    {
+#ifdef SETTING_HAVE_ZLIB
+        std::vector<char> out(chunk_size);
+        z_stream zs;
+        int ret = Z_OK;
+
+        memset(&zs, 0, sizeof(zs));
+        // 32 lets zlib detect gzip and zlib headers
+        if (inflateInit2(&zs, 15 + 32) != Z_OK)
+            throw std::runtime_error("can not initialize zlib.");
+        try {
+            while (n > 0 && ret != Z_STREAM_END) {
+                zs.next_in = reinterpret_cast<Bytef *>(&(*in)[0]);
+                zs.avail_in = static_cast<uInt>(n);
+                do {
+                    zs.next_out = reinterpret_cast<Bytef *>(&out[0]);
+                    zs.avail_out = static_cast<uInt>(out.size());
+                    ret = inflate(&zs, Z_NO_FLUSH);
+                    if (ret != Z_OK && ret != Z_STREAM_END
+                        && ret != Z_BUF_ERROR)
+                        throw std::runtime_error(
+                                std::string("corrupted configuration file ") +
+                                std::string(filename) + std::string("."));
+                    feed(&out[0], out.size() - zs.avail_out, h);
+                } while (zs.avail_out == 0 && ret != Z_STREAM_END);
+                n = fread(&(*in)[0], 1, in->size(), fp);
+            }
+        } catch (...) {
+            inflateEnd(&zs);
+            throw;
+        }
+        inflateEnd(&zs);
+        if (ret != Z_STREAM_END)
+            throw std::runtime_error(
+                    std::string("truncated configuration file ") +
+                    std::string(filename) + std::string("."));
+#else
+        (void)fp; (void)in; (void)n; (void)h;
+        throw std::runtime_error(
+                std::string("gzip configuration file ") +
+                std::string(filename) +
+                std::string(" needs SETTING_HAVE_ZLIB."));
+#endif
+    }
+
+    /**
+     * Decompresses a zstd stream whose first n bytes are already in
+     * in, feeding the text chunk by chunk.
+     */
+    template <class Handler>
+    void read_zstd(FILE *fp, const char *filename, std::vector<char> *in,
+                   size_t n, Handler *h)
+    {
+#ifdef SETTING_HAVE_ZSTD
+        std::vector<char> out(ZSTD_DStreamOutSize());
+        ZSTD_DStream *zs = ZSTD_createDStream();
+        size_t ret = 1;
+
+        ZSTD_initDStream(zs);
+        try {
+            while (n > 0) {
+                ZSTD_inBuffer ib = { &(*in)[0], n, 0 };
+                while (ib.pos < ib.size) {
+                    ZSTD_outBuffer ob = { &out[0], out.size(), 0 };
+                    ret = ZSTD_decompressStream(zs, &ob, &ib);
+                    if (ZSTD_isError(ret))
+                        throw std::runtime_error(
+                                std::string("corrupted configuration file ") +
+                                std::string(filename) + std::string("."));
+                    feed(&out[0], ob.pos, h);
+                }
+                n = fread(&(*in)[0], 1, in->size(), fp);
+            }
+            // flush whatever is still buffered inside the decoder
+            while (ret != 0) {
+                ZSTD_inBuffer ib = { NULL, 0, 0 };
+                ZSTD_outBuffer ob = { &out[0], out.size(), 0 };
+                ret = ZSTD_decompressStream(zs, &ob, &ib);
+                if (ZSTD_isError(ret) || ob.pos == 0)
+                    throw std::runtime_error(
+                            std::string("truncated configuration file ") +
+                            std::string(filename) + std::string("."));
+                feed(&out[0], ob.pos, h);
+            }
+        } catch (...) {
+            ZSTD_freeDStream(zs);
+            throw;
+        }
+        ZSTD_freeDStream(zs);
+#else
+        (void)fp; (void)in; (void)n; (void)h;
+        throw std::runtime_error(
+                std::string("zstd configuration file ") +
+                std::string(filename) +
+                std::string(" needs SETTING_HAVE_ZSTD."));
+#endif
+    }
+
+    /** A line split between chunks. */
+    std::string carry_;
+    /** Number of lines seen. */
+    size_t line_;
+    /** Keys to hand to the handler, or NULL for all. */
+    const projection *keys_;
+    /** Name of the current section, empty at the top level. */
+    std::string section_;
+    /** Key with its section prepended. */
+    std::string key_;
+    /** A decoded quoted value. */
+    std::string value_;
+    /** Whether the last line ended with a backslash. */
+    bool joining_;
+    /** Continued lines so far. */
+    std::string joined_;
+    size_t joined_line_;
+    /** Terminator of the open here-document, or empty. */
+    std::string tag_;
+    std::string here_key_;
+    size_t here_line_;
+    /** Whether the projection keeps the here-document. */
+    bool here_keep_;
+    size_t body_lines_;
+    /** Whether the body so far is [begin_, end_) of the chunk. */
+    bool spanning_;
+    const char *begin_;
+    const char *end_;
+    /** The body so far if not spanning_. */
+    std::string body_;
+};
+
+/**
+ * Scans a configuration file without storing it, calling
+ * h->item(key, value, line) for every item. See scanner.
+ *
+ * @param filename Filename of the configuration.
+ * @param h        The handler.
+ */
+template <class Handler>
+void scan_file(const char *filename, Handler *h)
+{
+    scanner().scan_file(filename, h);
+}
+
+/**
+ * Scans a configuration file, calling h->item(key, value, line) only
+ * for the items whose key matches keys. See scanner.
+ *
+ * @param filename Filename of the configuration.
+ * @param keys     The keys to report.
+ * @param h        The handler.
+ */
+template <class Handler>
+void scan_file(const char *filename, const projection &keys, Handler *h)
+{
+    scanner(&keys).scan_file(filename, h);
+}
+
+/**
+ * Scans configuration text in memory, calling h->item(key, value, line)
+ * for every item. See scanner.
+ *
+ * @param data   The text.
+ * @param size   Size of the text in bytes.
+ * @param h      The handler.
+ */
+template <class Handler>
+void scan_buffer(const char *data, size_t size, Handler *h)
+{
+    scanner s;
+    s.feed(data, size, h);
+    s.finish(h);
+}
+
+/** @} */
+
+END_SETTING_NAMESPACE
+
+#endif  // SETTING_SCAN_H_
+
+// vim: ts=4 sw=4 et ai cindent
@@ -0,0 +1,458 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef SETTING_SERVER_H_
+#define SETTING_SERVER_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include "setting.h"
+#include "setting_notify.h"
+
+BEGIN_SETTING_NAMESPACE
+
+/** @addtogroup setting_api libsetting API
+ *
+ *  @{
+ */
+
+/**
+ * Serves settings over a Unix domain socket.
+ *
+ * The server owns a set of configuration files. Clients may look up
+ * single resolved values, fetch a whole raw snapshot, or subscribe to
+ * change notifications which are pushed every time reload() publishes
+ * a new version. See wire::opcode for the message layout. Processes
+ * that do not keep a connection can follow the version through a
+ * generation_counter, see notify_through().
+ *
+ * The server is single threaded; call run_once() from your own loop or
+ * run() to serve until stop().
+ */
+class setting_server {
+  public:
+    /**
+     * Creates a server listening on path. A stale socket file at path
+     * is removed.
+     *
+     * @param path     Filesystem path of the Unix socket.
+     * @param level    Maximum recursion level of served settings.
+     */
+    explicit setting_server(const char *path, size_t level = 3)
+        :path_(path), level_(level), version_(0), running_(false),
+         out_limit_(default_out_limit), cfg_(new setting(level)),
+         notify_(NULL)
+    {
+        struct sockaddr_un addr;
+
+        if (path_.size() >= sizeof(addr.sun_path)) {
+            delete cfg_;
+            throw std::runtime_error(
+                    std::string("socket path too long ") + path_ + ".");
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path_.c_str());
+
+        listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(path_.c_str());
+        if (listen_fd_ < 0
+            || bind(listen_fd_, reinterpret_cast<struct sockaddr *>(&addr),
+                    sizeof(addr)) < 0
+            || listen(listen_fd_, 64) < 0) {
+            std::string err(strerror(errno));
+            if (listen_fd_ >= 0)
+                close(listen_fd_);
+            delete cfg_;
+            throw std::runtime_error(
+                    std::string("can not listen on ") + path_ +
+                    std::string(": ") + err + std::string("."));
+        }
+        set_nonblock(listen_fd_);
+        cfg_->serialize(&snapshot_);
+    }
+
+    ~setting_server()
+    {
+        for (size_t i = 0; i < clients_.size(); i++)
+            close(clients_[i].fd);
+        close(listen_fd_);
+        unlink(path_.c_str());
+        delete cfg_;
+        delete notify_;
+    }
+
+    /**
+     * Adds a configuration file to be served. Takes effect on the next
+     * reload().
+     *
+     * @param filename Filename of the configuration.
+     */
+    void add_file(const char *filename)
+    {
+        files_.push_back(filename);
+    }
+
+    /**
+     * Limits the replies and notifications queued for a client that
+     * does not read them. A client with more than bytes plus one
+     * snapshot pending is disconnected.
+     *
+     * @param bytes Bytes that may be queued besides one snapshot.
+     */
+    void set_output_limit(size_t bytes)
+    {
+        out_limit_ = bytes;
+    }
+
+    /**
+     * Stores every published version in a generation_counter kept in
+     * a file, starting with the current one.
+     *
+     * @param path  The file of the counter, e.g. in /dev/shm.
+     */
+    void notify_through(const char *path)
+    {
+        generation_counter *counter = new generation_counter(path);
+        delete notify_;
+        notify_ = counter;
+        notify_->publish(version_);
+    }
+
+    /**
+     * Re-reads all files and publishes them as a new version. On error
+     * the previous version keeps being served and the exception is
+     * rethrown.
+     */
+    void reload()
+    {
+        setting *fresh = new setting(level_);
+        try {
+            for (size_t i = 0; i < files_.size(); i++)
+                fresh->read_from_file(files_[i].c_str());
+        } catch (...) {
+            delete fresh;
+            throw;
+        }
+        publish(fresh);
+    }
+
+    /**
+     * Publishes a new configuration, taking ownership of it, and pushes
+     * a notification to all subscribers.
+     *
+     * @param fresh The new configuration, allocated with new.
+     */
+    void publish(setting *fresh)
+    {
+        std::string msg;
+        size_t start;
+
+        setting::make_delta(*cfg_, *fresh, &delta_);
+        delete cfg_;
+        cfg_ = fresh;
+        version_++;
+        cfg_->serialize(&snapshot_);
+
+        start = wire::begin_frame(&msg, wire::OP_NOTIFY);
+        wire::put_u32(&msg, version_);
+        wire::end_frame(&msg, start);
+        for (size_t i = 0; i < clients_.size(); i++) {
+            if (clients_[i].subscribed) {
+                clients_[i].out.append(msg);
+                flush(&clients_[i]);
+            }
+        }
+        reap();
+        if (notify_ != NULL)
+            notify_->publish(version_);
+    }
+
+    /** Returns the version currently served. */
+    uint32_t version() const { return version_; }
+
+    /** Returns the configuration currently served. */
+    const setting& config() const { return *cfg_; }
+
+    /** Returns the number of connected clients. */
+    size_t clients() const { return clients_.size(); }
+
+    /**
+     * Waits for socket events once and handles them.
+     *
+     * @param timeout_ms Maximum time to wait in milliseconds, -1 to
+     *                   wait forever.
+     */
+    void run_once(int timeout_ms)
+    {
+        std::vector<struct pollfd> fds(clients_.size() + 1);
+
+        fds[0].fd = listen_fd_;
+        fds[0].events = POLLIN;
+        for (size_t i = 0; i < clients_.size(); i++) {
+            fds[i + 1].fd = clients_[i].fd;
+            fds[i + 1].events = clients_[i].eof ? 0 : POLLIN;
+            if (!clients_[i].out.empty())
+                fds[i + 1].events |= POLLOUT;
+        }
+        if (poll(&fds[0], fds.size(), timeout_ms) <= 0)
+            return;
+
+        // clients_ only grows in accept_all(), so indexes stay valid
+        for (size_t i = 1; i < fds.size(); i++) {
+            client &c = clients_[i - 1];
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                receive(&c);
+            if (c.fd >= 0 && (fds[i].revents & POLLOUT))
+                flush(&c);
+        }
+        if (fds[0].revents & POLLIN)
+            accept_all();
+        reap();
+    }
+
+    /** Serves until stop() is called. */
+    void run()
+    {
+        running_ = true;
+        while (running_)
+            run_once(-1);
+    }
+
+    /** Makes run() return after the current iteration. */
+    void stop() { running_ = false; }
+
+  private:
+    /** Default of set_output_limit(). */
+    static const size_t default_out_limit = 4 << 20;
+
+    struct client {
+        int fd;
+        bool subscribed;
+        bool eof;           ///< Client shut down its side.
+        std::string in;
+        std::string out;
+    };
+
+    static void set_nonblock(int fd)
+    {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    }
+
+    void accept_all()
+    {
+        int fd;
+
+        while ((fd = accept(listen_fd_, NULL, NULL)) >= 0) {
+            client c;
+            set_nonblock(fd);
+            c.fd = fd;
+            c.subscribed = false;
+            c.eof = false;
+            clients_.push_back(c);
+        }
+    }
+
+    /**
+     * Reads and answers the requests of a client. Requests that arrived
+     * before the client shut down its side are still answered.
+     */
+    void receive(client *c)
+    {
+        char buf[65536];
+        size_t got = 0;
+        ssize_t n;
+
+        // a chunk per round, so a client that keeps sending can not
+        // make us buffer without answering
+        for (;;) {
+            n = recv(c->fd, buf, sizeof(buf), 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            c->in.append(buf, n);
+            got += n;
+            if (got >= sizeof(buf))
+                break;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            drop(c);
+            return;
+        }
+
+        uint8_t op;
+        std::string body;
+        try {
+            while (c->fd >= 0 && wire::take_frame(&c->in, &op, &body)) {
+                handle(c, op, body);
+                if (c->out.size() > out_limit_)
+                    flush(c);
+            }
+        } catch (const std::exception &) {
+            drop(c);
+            return;
+        }
+        if (n == 0)
+            c->eof = true;
+        flush(c);
+    }
+
+    void handle(client *c, uint8_t op, const std::string &body)
+    {
+        size_t start;
+        std::string key;
+
+        switch (op) {
+          case wire::OP_GET:
+            wire::reader(body.data(), body.size()).get_string(&key);
+            start = wire::begin_frame(&c->out, wire::OP_VALUE);
+            if (const char *v = cfg_->get_cstr(key)) {
+                wire::put_u8(&c->out, 1);
+                wire::put_string(&c->out, v);
+            } else {
+                wire::put_u8(&c->out, 0);
+                wire::put_string(&c->out, std::string());
+            }
+            wire::end_frame(&c->out, start);
+            break;
+          case wire::OP_SNAPSHOT:
+            start = wire::begin_frame(&c->out, wire::OP_SNAPSHOT_DATA);
+            wire::put_u32(&c->out, version_);
+            c->out.append(snapshot_);
+            wire::end_frame(&c->out, start);
+            break;
+          case wire::OP_DELTA:
+            start = wire::begin_frame(&c->out, wire::OP_DELTA_DATA);
+            wire::put_u32(&c->out, version_);
+            if (version_ > 0 && wire::reader(body.data(), body.size())
+                                .get_u32() == version_ - 1) {
+                wire::put_u8(&c->out, 1);
+                c->out.append(delta_);
+            } else {
+                wire::put_u8(&c->out, 0);
+                c->out.append(snapshot_);
+            }
+            wire::end_frame(&c->out, start);
+            break;
+          case wire::OP_SUBSCRIBE:
+            c->subscribed = true;
+            break;
+          default:
+            start = wire::begin_frame(&c->out, wire::OP_ERROR);
+            wire::put_string(&c->out, "unknown opcode.");
+            wire::end_frame(&c->out, start);
+            break;
+        }
+    }
+
+    /**
+     * Sends what the socket takes. Drops the client if more than the
+     * output limit stays queued, or once a client that shut down its
+     * side has got all replies.
+     */
+    void flush(client *c)
+    {
+        ssize_t n;
+
+        while (c->fd >= 0 && !c->out.empty()) {
+            n = send(c->fd, c->out.data(), c->out.size(), MSG_NOSIGNAL);
+            if (n > 0) {
+                c->out.erase(0, n);
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else {
+                if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                    drop(c);
+                break;
+            }
+        }
+        if (c->fd >= 0 && (c->out.size() > out_limit_ + snapshot_.size()
+                           || (c->eof && c->out.empty())))
+            drop(c);
+    }
+
+    void drop(client *c)
+    {
+        if (c->fd >= 0)
+            close(c->fd);
+        c->fd = -1;
+    }
+
+    /** Removes dropped clients. */
+    void reap()
+    {
+        size_t j = 0;
+        for (size_t i = 0; i < clients_.size(); i++) {
+            if (clients_[i].fd >= 0) {
+                if (i != j)
+                    clients_[j] = clients_[i];
+                j++;
+            }
+        }
+        clients_.resize(j);
+    }
+
+    std::string path_;
+    size_t level_;
+    uint32_t version_;
+    bool running_;
+    int listen_fd_;
+    /** See set_output_limit(). */
+    size_t out_limit_;
+    setting *cfg_;
+    /** Serialized cfg_, shared by every OP_SNAPSHOT reply. */
+    std::string snapshot_;
+    /** Delta from version_ - 1 to version_. */
+    std::string delta_;
+    std::vector<std::string> files_;
+    std::vector<client> clients_;
+    /** Counter following version_, see notify_through(). */
+    generation_counter *notify_;
+
+    DISALLOW_COPY_AND_ASSIGN(setting_server);
+};
+
+/** @} */
+
+END_SETTING_NAMESPACE
+
+#endif  // SETTING_SERVER_H_
+
+// vim: ts=4 sw=4 et ai cindent
@@ -0,0 +1,2708 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef SETTING_STORAGE_H_
+#define SETTING_STORAGE_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <memory>
+#include <new>
+#include <set>
+#include <string>
+#include <stdexcept>
+#include <vector>
+
+#include "setting_wire.h"
+
+BEGIN_SETTING_NAMESPACE
+
+/** @addtogroup setting_api libsetting API
+ *
+ *  @{
+ */
+
+/**
+ * A non-owning view of a string. Views handed out by a storage are
+ * valid until that storage is next modified.
+ */
+struct string_ref {
+    const char *data;
+    size_t size;
+
+    string_ref(): data(""), size(0) {}
+    string_ref(const char *d, size_t n): data(d), size(n) {}
+    string_ref(const std::string &s): data(s.data()), size(s.size()) {}
+
+    bool empty() const { return size == 0; }
+    std::string str() const { return std::string(data, size); }
+};
+
+inline bool operator==(const string_ref &a, const string_ref &b)
+{
+    return a.size == b.size && memcmp(a.data, b.data, a.size) == 0;
+}
+
+inline bool operator!=(const string_ref &a, const string_ref &b)
+{
+    return !(a == b);
+}
+
+inline bool operator<(const string_ref &a, const string_ref &b)
+{
+    int c = memcmp(a.data, b.data, std::min(a.size, b.size));
+    return c < 0 || (c == 0 && a.size < b.size);
+}
+
+/** Memory used by a setting or by a part of it, in bytes. */
+struct memory_stats {
+    size_t count;       ///< Number of keys.
+    size_t keys;        ///< Key text.
+    size_t values;      ///< Value text, compressed size for cold values.
+    size_t index;       ///< Lookup structures: tree links, hash tables.
+    size_t caches;      ///< Derived data that can be recomputed.
+    size_t overhead;    ///< Object headers, allocator and capacity slack,
+                        ///< dead bytes.
+
+    memory_stats(): count(0), keys(0), values(0), index(0), caches(0),
+                    overhead(0) {}
+
+    size_t total() const
+    {
+        return keys + values + index + caches + overhead;
+    }
+
+    memory_stats& operator+=(const memory_stats &o)
+    {
+        count += o.count;
+        keys += o.keys;
+        values += o.values;
+        index += o.index;
+        caches += o.caches;
+        overhead += o.overhead;
+        return *this;
+    }
+};
+
+/**
+ * Estimates the size of the heap block malloc hands out for a request
+ * of n bytes, header included.
+ */
+inline size_t heap_block(size_t n)
+{
+    size_t b = (n + sizeof(size_t) + 15) & ~static_cast<size_t>(15);
+    return (b < 32) ? 32 : b;
+}
+
+/** Bytes a std::string takes beyond its text, heap block included. */
+inline size_t string_overhead(const std::string &s)
+{
+    const char *self = reinterpret_cast<const char *>(&s);
+    if (s.data() >= self && s.data() < self + sizeof(s))
+        return sizeof(s) - s.size();
+    return sizeof(s) + heap_block(s.capacity() + 1) - s.size();
+}
+
+/** Hints the processor to load the cache line holding p. */
+inline void prefetch_line(const void *p)
+{
+#ifdef __GNUC__
+    __builtin_prefetch(p);
+#else
+    (void)p;
+#endif
+}
+
+/** Size of a huge page, the unit of huge_page_allocator mappings. */
+const size_t huge_page_size = 2 << 20;
+
+/**
+ * Allocator placing blocks of at least huge_page_size bytes on huge
+ * pages, so that random reads of a large array miss the TLB less.
+ *
+ * Such blocks are mapped with MAP_HUGETLB if the system has reserved
+ * huge pages; otherwise they are aligned to huge_page_size and marked
+ * MADV_HUGEPAGE for transparent huge pages. Where neither is available
+ * they end up on normal pages. Smaller blocks come from operator new.
+ */
+template <class T>
+class huge_page_allocator {
+  public:
+    typedef T value_type;
+    typedef T *pointer;
+    typedef const T *const_pointer;
+    typedef T &reference;
+    typedef const T &const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <class U>
+    struct rebind {
+        typedef huge_page_allocator<U> other;
+    };
+
+    huge_page_allocator() {}
+    template <class U>
+    huge_page_allocator(const huge_page_allocator<U> &) {}
+
+    pointer address(reference x) const { return &x; }
+    const_pointer address(const_reference x) const { return &x; }
+
+    pointer allocate(size_type n, const void * = NULL)
+    {
+        size_t bytes = n * sizeof(T);
+        if (n > max_size())
+            throw std::bad_alloc();
+        if (bytes < huge_page_size)
+            return static_cast<pointer>(::operator new(bytes));
+        return static_cast<pointer>(map_pages(round_up(bytes)));
+    }
+
+    void deallocate(pointer p, size_type n)
+    {
+        size_t bytes = n * sizeof(T);
+        if (bytes < huge_page_size)
+            ::operator delete(p);
+        else
+            munmap(p, round_up(bytes));
+    }
+
+    size_type max_size() const
+    {
+        return static_cast<size_t>(-1) / sizeof(T);
+    }
+
+    void construct(pointer p, const T &value) { new (p) T(value); }
+    void destroy(pointer p) { p->~T(); }
+
+    bool operator==(const huge_page_allocator &) const { return true; }
+    bool operator!=(const huge_page_allocator &) const { return false; }
+
+  private:
+    static size_t round_up(size_t bytes)
+    {
+        return (bytes + huge_page_size - 1) & ~(huge_page_size - 1);
+    }
+
+    static void *map_pages(size_t len)
+    {
+        char *p;
+#ifdef MAP_HUGETLB
+        p = static_cast<char *>(mmap(NULL, len, PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS
+                                     | MAP_HUGETLB, -1, 0));
+        if (p != MAP_FAILED)
+            return p;
+#endif
+        // map one page more and trim, to align for transparent pages
+        p = static_cast<char *>(mmap(NULL, len + huge_page_size,
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (p == MAP_FAILED)
+            throw std::bad_alloc();
+        size_t head = (huge_page_size - reinterpret_cast<uintptr_t>(p)
+                       % huge_page_size) % huge_page_size;
+        if (head > 0)
+            munmap(p, head);
+        munmap(p + head + len, huge_page_size - head);
+#ifdef MADV_HUGEPAGE
+        madvise(p + head, len, MADV_HUGEPAGE);
+#endif
+        return p + head;
+    }
+};
+
+/**
+ * @section Storage
+ *
+ * A storage holds the raw key-value pairs of a setting. Every storage
+ * provides
+ *
+ * @code
+ * class const_iterator;      // key(), value(), ++, ==, !=
+ * const_iterator begin() const;  // visits keys in ascending order
+ * const_iterator end() const;
+ * bool find(const std::string &key, string_ref *value) const;
+ * void prefetch(const std::string &key) const;  // find(key) is near
+ * void set(const std::string &key, string_ref value);
+ * bool erase(const std::string &key);
+ * size_t size() const;
+ * void clear();
+ * void commit();             // bulk load finished, may reorganize
+ * void swap(Storage &other); // in constant time
+ *
+ * // reports memory: v->entry(string_ref key, const memory_stats &)
+ * // once per key, v->shared(const memory_stats &) for the rest
+ * template <class Visitor> void memory(Visitor *v) const;
+ * @endcode
+ *
+ * The storage is the first template parameter of basic_setting. The
+ * setting typedef uses SETTING_STORAGE, map_storage unless defined
+ * before including setting.h.
+ */
+
+/**
+ * Storage on a std::map, one tree node and two std::string per key.
+ *
+ * @tparam PairAllocator  Allocator of the map nodes.
+ */
+template <class PairAllocator =
+              std::allocator<std::pair<const std::string, std::string> > >
+class basic_map_storage {
+  public:
+    typedef std::map<std::string, std::string, std::less<std::string>,
+                     PairAllocator> map_type;
+
+    class const_iterator {
+      public:
+        const_iterator() {}
+        explicit const_iterator(typename map_type::const_iterator it)
+            :it_(it) {}
+
+        string_ref key() const { return it_->first; }
+        string_ref value() const { return it_->second; }
+        const_iterator& operator++() { ++it_; return *this; }
+        bool operator==(const const_iterator &o) const { return it_ == o.it_; }
+        bool operator!=(const const_iterator &o) const { return it_ != o.it_; }
+
+      private:
+        typename map_type::const_iterator it_;
+    };
+
+    const_iterator begin() const { return const_iterator(map_.begin()); }
+    const_iterator end() const { return const_iterator(map_.end()); }
+
+    bool find(const std::string &key, string_ref *value) const
+    {
+        typename map_type::const_iterator found = map_.find(key);
+        if (found == map_.end())
+            return false;
+        *value = found->second;
+        return true;
+    }
+
+    void set(const std::string &key, string_ref value)
+    {
+        map_[key].assign(value.data, value.size);
+    }
+
+    bool erase(const std::string &key)
+    {
+        return map_.erase(key) > 0;
+    }
+
+    size_t size() const { return map_.size(); }
+    void clear() { map_.clear(); }
+    /** Tree nodes are found only by walking, so nothing to hint. */
+    void prefetch(const std::string &) const {}
+
+    void commit() {}
+    void swap(basic_map_storage &o) { map_.swap(o.map_); }
+
+    template <class Visitor>
+    void memory(Visitor *v) const
+    {
+        // a tree node is the colour and three links, then the pair
+        const size_t links = 4 * sizeof(void *);
+        const size_t node = links + sizeof(typename map_type::value_type);
+        typename map_type::const_iterator it;
+        memory_stats shared;
+
+        for (it = map_.begin(); it != map_.end(); ++it) {
+            memory_stats m;
+            m.count = 1;
+            m.keys = it->first.size();
+            m.values = it->second.size();
+            m.index = links;
+            m.overhead = heap_block(node) - node
+                         + string_overhead(it->first)
+                         + string_overhead(it->second);
+            v->entry(it->first, m);
+        }
+        shared.overhead = sizeof(*this);
+        v->shared(shared);
+    }
+
+  private:
+    map_type map_;
+};
+
+/** Storage on a std::map with the default allocator. */
+typedef basic_map_storage<> map_storage;
+
+/**
+ * Storage with keys and values inline in fixed-size slots.
+ *
+ * Every key-value pair takes one 32-byte slot in a flat array. Keys and
+ * values of up to inline_size bytes live inside the slot; longer ones
+ * are appended to a side arena and the slot keeps their offset. Slots
+ * are found through an open-addressing index of 32-bit slot numbers, so
+ * a short pair costs 32 bytes plus about 8 bytes of index, and a scan
+ * walks one contiguous array.
+ */
+class inline_storage {
+  public:
+    /** Longest key or value stored inside a slot. */
+    static const size_t inline_size = 15;
+
+    inline_storage(): garbage_(0), sorted_(true) {}
+
+    class const_iterator {
+      public:
+        const_iterator(): owner_(NULL), pos_(0) {}
+        const_iterator(const inline_storage *owner, size_t pos)
+            :owner_(owner), pos_(pos) {}
+
+        string_ref key() const
+        {
+            return owner_->ref(owner_->slots_[owner_->order_[pos_]].key);
+        }
+
+        string_ref value() const
+        {
+            return owner_->ref(owner_->slots_[owner_->order_[pos_]].value);
+        }
+
+        const_iterator& operator++() { ++pos_; return *this; }
+        bool operator==(const const_iterator &o) const { return pos_ == o.pos_; }
+        bool operator!=(const const_iterator &o) const { return pos_ != o.pos_; }
+
+      private:
+        const inline_storage *owner_;
+        size_t pos_;
+    };
+
+    /** Iterates in key order. Sorting is done once after a change. */
+    const_iterator begin() const
+    {
+        sort();
+        return const_iterator(this, 0);
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(this, slots_.size());
+    }
+
+    bool find(const std::string &key, string_ref *value) const
+    {
+        size_t pos;
+        if (!locate(key, &pos))
+            return false;
+        *value = ref(slots_[index_[pos] - 1].value);
+        return true;
+    }
+
+    /** Loads the index position of key; the slot depends on it. */
+    void prefetch(const std::string &key) const
+    {
+        if (!index_.empty())
+            prefetch_line(&index_[hash(key) & (index_.size() - 1)]);
+    }
+
+    void set(const std::string &key, string_ref value)
+    {
+        size_t pos;
+        std::string copy;
+
+        if (value.size > inline_size && value.data >= arena_.data()
+            && value.data < arena_.data() + arena_.size()) {
+            // value lives in our arena, which put() may reallocate
+            copy.assign(value.data, value.size);
+            value = copy;
+        }
+        if (locate(key, &pos)) {
+            slot &s = slots_[index_[pos] - 1];
+            release(s.value);
+            put(&s.value, value);
+            compact();
+            return;
+        }
+        if ((slots_.size() + 1) * 2 > index_.size()) {
+            grow();
+            locate(key, &pos);
+        }
+        if (slots_.size() >= 0xffffffffUL)
+            throw std::runtime_error("too many keys.");
+        slots_.push_back(slot());
+        put(&slots_.back().key, key);
+        put(&slots_.back().value, value);
+        index_[pos] = static_cast<uint32_t>(slots_.size());
+        sorted_ = false;
+    }
+
+    bool erase(const std::string &key)
+    {
+        size_t pos, last_pos;
+        if (!locate(key, &pos))
+            return false;
+
+        uint32_t id = index_[pos] - 1;
+        release(slots_[id].key);
+        release(slots_[id].value);
+        unlink(pos);
+
+        // move the last slot into the hole to keep the array dense
+        uint32_t last = static_cast<uint32_t>(slots_.size() - 1);
+        if (id != last) {
+            locate(ref(slots_[last].key), &last_pos);
+            index_[last_pos] = id + 1;
+            slots_[id] = slots_[last];
+        }
+        slots_.pop_back();
+        sorted_ = false;
+        compact();
+        return true;
+    }
+
+    size_t size() const { return slots_.size(); }
+    void commit() {}
+
+    template <class Visitor>
+    void memory(Visitor *v) const
+    {
+        memory_stats shared;
+
+        for (size_t id = 0; id < slots_.size(); id++) {
+            memory_stats m;
+            string_ref key = ref(slots_[id].key);
+            string_ref value = ref(slots_[id].value);
+            m.count = 1;
+            m.keys = key.size;
+            m.values = value.size;
+            m.overhead = sizeof(slot)
+                         - ((key.size <= inline_size) ? key.size : 0)
+                         - ((value.size <= inline_size) ? value.size : 0);
+            v->entry(key, m);
+        }
+        shared.index = (index_.capacity() + order_.capacity())
+                       * sizeof(uint32_t);
+        shared.overhead = sizeof(*this)
+                          + (slots_.capacity() - slots_.size()) * sizeof(slot)
+                          + (arena_.capacity() - arena_.size()) + garbage_;
+        v->shared(shared);
+    }
+
+    void clear()
+    {
+        slots_.clear();
+        index_.clear();
+        arena_.clear();
+        order_.clear();
+        garbage_ = 0;
+        sorted_ = true;
+    }
+
+    void swap(inline_storage &o)
+    {
+        slots_.swap(o.slots_);
+        index_.swap(o.index_);
+        arena_.swap(o.arena_);
+        order_.swap(o.order_);
+        std::swap(garbage_, o.garbage_);
+        std::swap(sorted_, o.sorted_);
+    }
+
+  private:
+    /**
+     * A key or a value. Short strings are stored in bytes with their
+     * length in the last byte; spilled strings store spilled in the
+     * last byte and their arena offset and size in the first eight.
+     */
+    struct field {
+        char bytes[inline_size + 1];
+    };
+
+    struct slot {
+        field key;
+        field value;
+    };
+
+    static const unsigned char spilled = 0xff;
+
+    static uint64_t hash(string_ref s)
+    {
+        return wire::mix64(wire::hash_bytes(wire::hash_seed, s.data, s.size));
+    }
+
+    static unsigned char tag(const field &f)
+    {
+        return static_cast<unsigned char>(f.bytes[inline_size]);
+    }
+
+    static uint32_t word(const field &f, size_t i)
+    {
+        uint32_t v;
+        memcpy(&v, f.bytes + i * 4, 4);
+        return v;
+    }
+
+    string_ref ref(const field &f) const
+    {
+        if (tag(f) == spilled)
+            return string_ref(arena_.data() + word(f, 0), word(f, 1));
+        return string_ref(f.bytes, tag(f));
+    }
+
+    void put(field *f, string_ref s)
+    {
+        memset(f->bytes, 0, sizeof(f->bytes));
+        if (s.size <= inline_size) {
+            memcpy(f->bytes, s.data, s.size);
+            f->bytes[inline_size] = static_cast<char>(s.size);
+            return;
+        }
+        if (arena_.size() + s.size > 0xffffffffUL)
+            throw std::runtime_error("arena is full.");
+        uint32_t off = static_cast<uint32_t>(arena_.size());
+        uint32_t size = static_cast<uint32_t>(s.size);
+        arena_.append(s.data, s.size);
+        memcpy(f->bytes, &off, 4);
+        memcpy(f->bytes + 4, &size, 4);
+        f->bytes[inline_size] = static_cast<char>(spilled);
+    }
+
+    /** Accounts for the arena bytes of a field about to be dropped. */
+    void release(const field &f)
+    {
+        if (tag(f) == spilled)
+            garbage_ += word(f, 1);
+    }
+
+    /**
+     * Finds the index position of key.
+     *
+     * @param pos  Set to the position of key, or to the empty position
+     *             where it would be inserted.
+     * @return true if key exists.
+     */
+    bool locate(string_ref key, size_t *pos) const
+    {
+        if (index_.empty()) {
+            *pos = 0;
+            return false;
+        }
+        size_t mask = index_.size() - 1;
+        for (size_t i = hash(key) & mask; ; i = (i + 1) & mask) {
+            if (index_[i] == 0) {
+                *pos = i;
+                return false;
+            }
+            if (ref(slots_[index_[i] - 1].key) == key) {
+                *pos = i;
+                return true;
+            }
+        }
+    }
+
+    /** Empties an index position, shifting back later entries. */
+    void unlink(size_t pos)
+    {
+        size_t mask = index_.size() - 1;
+        size_t hole = pos;
+
+        for (size_t i = (pos + 1) & mask; index_[i] != 0; i = (i + 1) & mask) {
+            size_t home = hash(ref(slots_[index_[i] - 1].key)) & mask;
+            // entries whose home lies cyclically in (hole, i] stay put
+            bool stays = (hole <= i) ? (hole < home && home <= i)
+                                     : (hole < home || home <= i);
+            if (!stays) {
+                index_[hole] = index_[i];
+                hole = i;
+            }
+        }
+        index_[hole] = 0;
+    }
+
+    void grow()
+    {
+        size_t n = index_.empty() ? 16 : index_.size() * 2;
+        size_t pos;
+
+        index_.assign(n, 0);
+        for (size_t id = 0; id < slots_.size(); id++) {
+            locate(ref(slots_[id].key), &pos);
+            index_[pos] = static_cast<uint32_t>(id + 1);
+        }
+    }
+
+    /** Rewrites the arena once more than half of it is dead. */
+    void compact()
+    {
+        if (garbage_ < 4096 || garbage_ * 2 < arena_.size())
+            return;
+
+        std::string fresh;
+        fresh.reserve(arena_.size() - garbage_);
+        for (size_t id = 0; id < slots_.size(); id++) {
+            field *fs[2] = { &slots_[id].key, &slots_[id].value };
+            for (int k = 0; k < 2; k++) {
+                if (tag(*fs[k]) != spilled)
+                    continue;
+                uint32_t off = static_cast<uint32_t>(fresh.size());
+                fresh.append(arena_, word(*fs[k], 0), word(*fs[k], 1));
+                memcpy(fs[k]->bytes, &off, 4);
+            }
+        }
+        arena_.swap(fresh);
+        garbage_ = 0;
+    }
+
+    struct key_less {
+        const inline_storage *owner;
+        bool operator()(uint32_t a, uint32_t b) const
+        {
+            return owner->ref(owner->slots_[a].key)
+                   < owner->ref(owner->slots_[b].key);
+        }
+    };
+
+    void sort() const
+    {
+        if (sorted_ && order_.size() == slots_.size())
+            return;
+        order_.resize(slots_.size());
+        for (size_t i = 0; i < order_.size(); i++)
+            order_[i] = static_cast<uint32_t>(i);
+        key_less less = { this };
+        std::sort(order_.begin(), order_.end(), less);
+        sorted_ = true;
+    }
+
+    std::vector<slot> slots_;
+    /** Slot number + 1 for each position, 0 if empty. */
+    std::vector<uint32_t> index_;
+    /** Keys and values longer than inline_size. */
+    std::string arena_;
+    /** Bytes of arena_ no longer referenced. */
+    size_t garbage_;
+    /** Slot numbers in key order, valid if sorted_. */
+    mutable std::vector<uint32_t> order_;
+    mutable bool sorted_;
+};
+
+/**
+ * Storage on an open-addressing hash table of std::string pairs.
+ *
+ * Buckets are probed linearly. Erased buckets become tombstones, which
+ * keep probe chains intact and are dropped when the table is rebuilt,
+ * on growth or on commit() once they make up a quarter of the table.
+ * Key order for iteration is computed once after each change.
+ */
+class hash_storage {
+  public:
+    hash_storage(): size_(0), used_(0), sorted_(true) {}
+
+    class const_iterator {
+      public:
+        const_iterator(): owner_(NULL), pos_(0) {}
+        const_iterator(const hash_storage *owner, size_t pos)
+            :owner_(owner), pos_(pos) {}
+
+        string_ref key() const
+        {
+            return owner_->buckets_[owner_->order_[pos_]].key;
+        }
+
+        string_ref value() const
+        {
+            return owner_->buckets_[owner_->order_[pos_]].value;
+        }
+
+        const_iterator& operator++() { ++pos_; return *this; }
+        bool operator==(const const_iterator &o) const { return pos_ == o.pos_; }
+        bool operator!=(const const_iterator &o) const { return pos_ != o.pos_; }
+
+      private:
+        const hash_storage *owner_;
+        size_t pos_;
+    };
+
+    const_iterator begin() const
+    {
+        sort();
+        return const_iterator(this, 0);
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(this, size_);
+    }
+
+    bool find(const std::string &key, string_ref *value) const
+    {
+        size_t pos;
+        if (!locate(key, hash(key), &pos))
+            return false;
+        *value = buckets_[pos].value;
+        return true;
+    }
+
+    /** Loads the home bucket of key. */
+    void prefetch(const std::string &key) const
+    {
+        if (!buckets_.empty())
+            prefetch_line(&buckets_[hash(key) & (buckets_.size() - 1)]);
+    }
+
+    void set(const std::string &key, string_ref value)
+    {
+        uint64_t h = hash(key);
+        size_t pos;
+
+        if (locate(key, h, &pos)) {
+            buckets_[pos].value.assign(value.data, value.size);
+            return;
+        }
+        if ((used_ + 1) * 4 > buckets_.size() * 3) {
+            std::string copy(value.data, value.size);
+            rehash(size_ + 1);
+            locate(key, h, &pos);
+            value = copy;
+            insert_at(pos, h, key, value);
+            return;
+        }
+        insert_at(pos, h, key, value);
+    }
+
+    bool erase(const std::string &key)
+    {
+        size_t pos;
+        if (!locate(key, hash(key), &pos))
+            return false;
+        buckets_[pos].hash = tombstone;
+        std::string().swap(buckets_[pos].key);
+        std::string().swap(buckets_[pos].value);
+        size_--;
+        sorted_ = false;
+        return true;
+    }
+
+    size_t size() const { return size_; }
+
+    void clear()
+    {
+        buckets_.clear();
+        order_.clear();
+        size_ = used_ = 0;
+        sorted_ = true;
+    }
+
+    void commit()
+    {
+        if ((used_ - size_) * 4 > buckets_.size())
+            rehash(size_);
+    }
+
+    void swap(hash_storage &o)
+    {
+        buckets_.swap(o.buckets_);
+        order_.swap(o.order_);
+        std::swap(size_, o.size_);
+        std::swap(used_, o.used_);
+        std::swap(sorted_, o.sorted_);
+    }
+
+    template <class Visitor>
+    void memory(Visitor *v) const
+    {
+        memory_stats shared;
+
+        for (size_t i = 0; i < buckets_.size(); i++) {
+            const bucket &b = buckets_[i];
+            if (b.hash == empty || b.hash == tombstone)
+                continue;
+            memory_stats m;
+            m.count = 1;
+            m.keys = b.key.size();
+            m.values = b.value.size();
+            m.index = sizeof(b.hash);
+            m.overhead = string_overhead(b.key) + string_overhead(b.value);
+            v->entry(b.key, m);
+        }
+        shared.index = order_.capacity() * sizeof(uint32_t);
+        shared.overhead = sizeof(*this)
+                          + (buckets_.capacity() - size_) * sizeof(bucket);
+        v->shared(shared);
+    }
+
+  private:
+    struct bucket {
+        uint64_t hash;          ///< empty, tombstone or the key's hash
+        std::string key;
+        std::string value;
+    };
+
+    static const uint64_t empty = 0;
+    static const uint64_t tombstone = 1;
+
+    static uint64_t hash(string_ref s)
+    {
+        uint64_t h = wire::mix64(wire::hash_bytes(wire::hash_seed,
+                                                  s.data, s.size));
+        return (h <= tombstone) ? h + 2 : h;
+    }
+
+    /**
+     * Finds key.
+     *
+     * @param pos  Set to the bucket of key, or to the bucket where it
+     *             should be inserted.
+     * @return true if key exists.
+     */
+    bool locate(string_ref key, uint64_t h, size_t *pos) const
+    {
+        size_t first_free = static_cast<size_t>(-1);
+
+        if (buckets_.empty()) {
+            *pos = 0;
+            return false;
+        }
+        size_t mask = buckets_.size() - 1;
+        for (size_t i = h & mask; ; i = (i + 1) & mask) {
+            const bucket &b = buckets_[i];
+            if (b.hash == empty) {
+                *pos = (first_free != static_cast<size_t>(-1)) ? first_free
+                                                                 : i;
+                return false;
+            }
+            if (b.hash == tombstone) {
+                if (first_free == static_cast<size_t>(-1))
+                    first_free = i;
+            } else if (b.hash == h && string_ref(b.key) == key) {
+                *pos = i;
+                return true;
+            }
+        }
+    }
+
+    void insert_at(size_t pos, uint64_t h, const std::string &key,
+                   string_ref value)
+    {
+        bucket &b = buckets_[pos];
+        if (b.hash == empty)
+            used_++;
+        b.hash = h;
+        b.key = key;
+        b.value.assign(value.data, value.size);
+        size_++;
+        sorted_ = false;
+    }
+
+    /** Rebuilds the table for n keys, dropping tombstones. */
+    void rehash(size_t n)
+    {
+        size_t cap = 16;
+        std::vector<bucket> old;
+
+        while (cap * 3 < n * 4 + 4)
+            cap *= 2;
+        old.swap(buckets_);
+        buckets_.resize(cap);
+        for (size_t i = 0; i < cap; i++)
+            buckets_[i].hash = empty;
+        used_ = size_;
+        for (size_t i = 0; i < old.size(); i++) {
+            if (old[i].hash == empty || old[i].hash == tombstone)
+                continue;
+            size_t j = old[i].hash & (cap - 1);
+            while (buckets_[j].hash != empty)
+                j = (j + 1) & (cap - 1);
+            buckets_[j].hash = old[i].hash;
+            buckets_[j].key.swap(old[i].key);
+            buckets_[j].value.swap(old[i].value);
+        }
+        sorted_ = false;
+    }
+
+    struct key_less {
+        const hash_storage *owner;
+        bool operator()(uint32_t a, uint32_t b) const
+        {
+            return string_ref(owner->buckets_[a].key)
+                   < string_ref(owner->buckets_[b].key);
+        }
+    };
+
+    void sort() const
+    {
+        if (sorted_)
+            return;
+        order_.clear();
+        order_.reserve(size_);
+        for (size_t i = 0; i < buckets_.size(); i++)
+            if (buckets_[i].hash != empty && buckets_[i].hash != tombstone)
+                order_.push_back(static_cast<uint32_t>(i));
+        key_less less = { this };
+        std::sort(order_.begin(), order_.end(), less);
+        sorted_ = true;
+    }
+
+    std::vector<bucket> buckets_;
+    /** Live keys. */
+    size_t size_;
+    /** Live keys and tombstones. */
+    size_t used_;
+    /** Bucket numbers of live keys in key order, valid if sorted_. */
+    mutable std::vector<uint32_t> order_;
+    mutable bool sorted_;
+};
+
+/** Picks huge_page_allocator or std::allocator. */
+template <class T, bool HugePages>
+struct page_allocator {
+    typedef std::allocator<T> type;
+};
+
+template <class T>
+struct page_allocator<T, true> {
+    typedef huge_page_allocator<T> type;
+};
+
+/**
+ * Read-mostly storage on sorted contiguous arrays.
+ *
+ * All keys are concatenated in key order into one buffer and all values
+ * into another, each with an array of offsets, and the first eight bytes
+ * of every key are kept as an integer to settle most comparisons without
+ * touching the key buffer. Lookups are binary searches; with Eytzinger
+ * set the search tree is laid out breadth-first so that the first levels
+ * share a few cache lines and the loop has no unpredictable branch on
+ * the result.
+ *
+ * The arrays are built once, by commit() after a load. Later writes go
+ * to a small sorted overlay which is merged in when it grows past a
+ * quarter of the arrays or when the storage is iterated, so heavy
+ * writing after load is slow by design. Iteration is in key order at no
+ * extra cost.
+ *
+ * With HugePages set the arrays are allocated by huge_page_allocator,
+ * which pays off once they reach hundreds of megabytes.
+ */
+template <bool Eytzinger, bool HugePages = false>
+class basic_flat_storage {
+    template <class T>
+    struct array {
+        typedef std::vector<T, typename page_allocator<T, HugePages>::type>
+                type;
+    };
+    typedef std::basic_string<char, std::char_traits<char>,
+                              typename page_allocator<char, HugePages>::type>
+            buffer_type;
+    typedef typename array<uint32_t>::type offsets_type;
+    typedef typename array<uint64_t>::type prefixes_type;
+
+  public:
+    basic_flat_storage(): size_(0), skip_(0) {}
+
+    class const_iterator {
+      public:
+        const_iterator(): owner_(NULL), pos_(0) {}
+        const_iterator(const basic_flat_storage *owner, size_t pos)
+            :owner_(owner), pos_(pos) {}
+
+        string_ref key() const { return owner_->key_at(pos_); }
+        string_ref value() const { return owner_->value_at(pos_); }
+        const_iterator& operator++() { ++pos_; return *this; }
+        bool operator==(const const_iterator &o) const { return pos_ == o.pos_; }
+        bool operator!=(const const_iterator &o) const { return pos_ != o.pos_; }
+
+      private:
+        const basic_flat_storage *owner_;
+        size_t pos_;
+    };
+
+    const_iterator begin() const
+    {
+        build();
+        return const_iterator(this, 0);
+    }
+
+    const_iterator end() const
+    {
+        build();
+        return const_iterator(this, count());
+    }
+
+    bool find(const std::string &key, string_ref *value) const
+    {
+        if (!overlay_.empty()) {
+            typename overlay_type::const_iterator found = overlay_.find(key);
+            if (found != overlay_.end()) {
+                if (found->second.erased)
+                    return false;
+                *value = found->second.value;
+                return true;
+            }
+        }
+        size_t i = search(key);
+        if (i == npos)
+            return false;
+        *value = value_at(i);
+        return true;
+    }
+
+    /** Every step of a search depends on the last, so nothing to hint. */
+    void prefetch(const std::string &) const {}
+
+    void set(const std::string &key, string_ref value)
+    {
+        string_ref old;
+        if (!find(key, &old))
+            size_++;
+        change &c = overlay_[key];
+        c.erased = false;
+        c.value.assign(value.data, value.size);
+        if (overlay_.size() > 64 + count() / 4)
+            build();
+    }
+
+    bool erase(const std::string &key)
+    {
+        string_ref old;
+        if (!find(key, &old))
+            return false;
+        size_--;
+        change &c = overlay_[key];
+        c.erased = true;
+        std::string().swap(c.value);
+        return true;
+    }
+
+    size_t size() const { return size_; }
+
+    void clear()
+    {
+        overlay_.clear();
+        keys_.clear();
+        values_.clear();
+        key_off_.clear();
+        value_off_.clear();
+        prefix_.clear();
+        eyt_index_.clear();
+        eyt_prefix_.clear();
+        size_ = 0;
+        skip_ = 0;
+    }
+
+    void commit() { build(); }
+
+    void swap(basic_flat_storage &o)
+    {
+        overlay_.swap(o.overlay_);
+        keys_.swap(o.keys_);
+        values_.swap(o.values_);
+        key_off_.swap(o.key_off_);
+        value_off_.swap(o.value_off_);
+        prefix_.swap(o.prefix_);
+        eyt_index_.swap(o.eyt_index_);
+        eyt_prefix_.swap(o.eyt_prefix_);
+        std::swap(size_, o.size_);
+        std::swap(skip_, o.skip_);
+    }
+
+    template <class Visitor>
+    void memory(Visitor *v) const
+    {
+        memory_stats shared;
+        size_t n;
+
+        build();
+        n = count();
+        for (size_t i = 0; i < n; i++) {
+            memory_stats m;
+            m.count = 1;
+            m.keys = key_off_[i + 1] - key_off_[i];
+            m.values = value_off_[i + 1] - value_off_[i];
+            m.index = 2 * sizeof(uint32_t) + sizeof(uint64_t)
+                      + (Eytzinger ? sizeof(uint32_t) + sizeof(uint64_t)
+                                   : 0);
+            v->entry(key_at(i), m);
+        }
+        shared.index = 2 * sizeof(uint32_t) + (Eytzinger ? 12 : 0);
+        shared.overhead = sizeof(*this)
+                + (keys_.capacity() - keys_.size())
+                + (values_.capacity() - values_.size())
+                + (key_off_.capacity() + value_off_.capacity()
+                   - 2 * key_off_.size()) * sizeof(uint32_t)
+                + (prefix_.capacity() - prefix_.size()) * sizeof(uint64_t);
+        v->shared(shared);
+    }
+
+  private:
+    static const size_t npos = static_cast<size_t>(-1);
+
+    /** A write not merged into the arrays yet. */
+    struct change {
+        bool erased;
+        std::string value;
+    };
+    typedef std::map<std::string, change> overlay_type;
+
+    size_t count() const
+    {
+        return key_off_.empty() ? 0 : key_off_.size() - 1;
+    }
+
+    string_ref key_at(size_t i) const
+    {
+        return string_ref(keys_.data() + key_off_[i],
+                          key_off_[i + 1] - key_off_[i]);
+    }
+
+    string_ref value_at(size_t i) const
+    {
+        return string_ref(values_.data() + value_off_[i],
+                          value_off_[i + 1] - value_off_[i]);
+    }
+
+    /**
+     * Eight bytes of s following the prefix common to all keys,
+     * big-endian and zero padded.
+     */
+    uint64_t prefix(string_ref s) const
+    {
+        uint64_t p = 0;
+        for (size_t i = skip_; i < skip_ + 8; i++)
+            p = (p << 8) | ((i < s.size) ? static_cast<unsigned char>(
+                                                   s.data[i]) : 0);
+        return p;
+    }
+
+    /** Tests if the key at i sorts before key, whose prefix is kp. */
+    bool before(size_t i, uint64_t ip, string_ref key, uint64_t kp) const
+    {
+        if (ip != kp)
+            return ip < kp;
+        return key_at(i) < key;
+    }
+
+    /** Returns the position of key in the arrays or npos. */
+    size_t search(string_ref key) const
+    {
+        size_t n = count();
+        uint64_t kp;
+        size_t i;
+
+        if (n == 0 || key.size < skip_
+            || memcmp(key.data, keys_.data(), skip_) != 0)
+            return npos;
+        kp = prefix(key);
+        if (Eytzinger) {
+            size_t k = 1;
+            while (k <= n) {
+#ifdef __GNUC__
+                if (k * 16 <= n)
+                    __builtin_prefetch(&eyt_prefix_[k * 16]);
+#endif
+                k = 2 * k + before(eyt_index_[k], eyt_prefix_[k], key, kp);
+            }
+            // climb back to the last node where we went left
+            while (k & 1)
+                k >>= 1;
+            k >>= 1;
+            if (k == 0)
+                return npos;
+            i = eyt_index_[k];
+        } else {
+            size_t lo = 0, len = n;
+            while (len > 1) {
+                size_t half = len / 2;
+                lo = before(lo + half - 1, prefix_[lo + half - 1], key, kp)
+                     ? lo + half : lo;
+                len -= half;
+            }
+            i = lo;
+            if (before(i, prefix_[i], key, kp))
+                return npos;
+        }
+        return (prefix_[i] == kp && key_at(i) == key) ? i : npos;
+    }
+
+    /** Merges the overlay into the arrays. */
+    void build() const
+    {
+        if (overlay_.empty())
+            return;
+
+        buffer_type keys, values;
+        offsets_type key_off, value_off;
+        typename overlay_type::const_iterator o = overlay_.begin();
+        size_t i = 0, n = count();
+
+        key_off.reserve(size_ + 1);
+        value_off.reserve(size_ + 1);
+        key_off.push_back(0);
+        value_off.push_back(0);
+        while (i < n || o != overlay_.end()) {
+            if (o == overlay_.end()
+                || (i < n && key_at(i) < string_ref(o->first))) {
+                append(key_at(i), value_at(i), &keys, &values, &key_off,
+                       &value_off);
+                i++;
+                continue;
+            }
+            if (i < n && key_at(i) == string_ref(o->first))
+                i++;
+            if (!o->second.erased)
+                append(o->first, o->second.value, &keys, &values,
+                       &key_off, &value_off);
+            ++o;
+        }
+        if (keys.size() > 0xffffffffUL || values.size() > 0xffffffffUL)
+            throw std::runtime_error("flat storage is full.");
+
+        keys_.swap(keys);
+        values_.swap(values);
+        key_off_.swap(key_off);
+        value_off_.swap(value_off);
+        overlay_.clear();
+
+        n = count();
+        skip_ = 0;
+        if (n > 1) {
+            string_ref first = key_at(0), last = key_at(n - 1);
+            while (skip_ < first.size && skip_ < last.size
+                   && first.data[skip_] == last.data[skip_])
+                skip_++;
+        }
+        prefix_.resize(n);
+        for (i = 0; i < n; i++)
+            prefix_[i] = prefix(key_at(i));
+        if (Eytzinger) {
+            eyt_index_.assign(n + 1, 0);
+            eyt_prefix_.assign(n + 1, 0);
+            eytzinger(0, 1);
+        }
+    }
+
+    static void append(string_ref key, string_ref value, buffer_type *keys,
+                       buffer_type *values, offsets_type *key_off,
+                       offsets_type *value_off)
+    {
+        keys->append(key.data, key.size);
+        values->append(value.data, value.size);
+        key_off->push_back(static_cast<uint32_t>(keys->size()));
+        value_off->push_back(static_cast<uint32_t>(values->size()));
+    }
+
+    /** Fills the breadth-first tree by an in-order walk. */
+    size_t eytzinger(size_t i, size_t k) const
+    {
+        if (k <= count()) {
+            i = eytzinger(i, 2 * k);
+            eyt_index_[k] = static_cast<uint32_t>(i);
+            eyt_prefix_[k] = prefix_[i];
+            i = eytzinger(i + 1, 2 * k + 1);
+        }
+        return i;
+    }
+
+    /** Live keys, overlay included. */
+    size_t size_;
+    // built lazily by const lookups and iteration
+    mutable overlay_type overlay_;
+    mutable buffer_type keys_;
+    mutable buffer_type values_;
+    mutable offsets_type key_off_;
+    mutable offsets_type value_off_;
+    /** Length of the prefix shared by all keys in the arrays. */
+    mutable size_t skip_;
+    /** prefix() of each key in the arrays. */
+    mutable prefixes_type prefix_;
+    /** Position in the sorted arrays of each node, 1-based. */
+    mutable offsets_type eyt_index_;
+    mutable prefixes_type eyt_prefix_;
+};
+
+/** Sorted arrays searched by plain binary search. */
+typedef basic_flat_storage<false> flat_storage;
+/** Sorted arrays searched in Eytzinger (breadth-first) order. */
+typedef basic_flat_storage<true> eytzinger_storage;
+
+/**
+ * Storage on a tree of dotted key segments.
+ *
+ * A key such as core.db.host is a path of three nodes, and every
+ * segment is stored once however many keys share it, so sectioned
+ * configurations with long common prefixes take little memory. A node
+ * finds its children by a linear scan while it has few and through an
+ * open-addressing hash index once it has more, so a lookup costs one
+ * probe per segment.
+ *
+ * Iteration materializes the full keys of all values in key order once
+ * after a change and keeps them until the next one.
+ */
+class tree_storage {
+  public:
+    tree_storage(): root_(NULL), size_(0), sorted_(true) {}
+    ~tree_storage() { destroy(root_); }
+
+    class const_iterator {
+      public:
+        const_iterator(): owner_(NULL), pos_(0) {}
+        const_iterator(const tree_storage *owner, size_t pos)
+            :owner_(owner), pos_(pos) {}
+
+        string_ref key() const { return owner_->entries_[pos_].first; }
+        string_ref value() const { return owner_->entries_[pos_].second->value; }
+        const_iterator& operator++() { ++pos_; return *this; }
+        bool operator==(const const_iterator &o) const { return pos_ == o.pos_; }
+        bool operator!=(const const_iterator &o) const { return pos_ != o.pos_; }
+
+      private:
+        const tree_storage *owner_;
+        size_t pos_;
+    };
+
+    const_iterator begin() const
+    {
+        sort();
+        return const_iterator(this, 0);
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(this, size_);
+    }
+
+    bool find(const std::string &key, string_ref *value) const
+    {
+        const node *n = lookup(key);
+        if (n == NULL || !n->has_value)
+            return false;
+        *value = n->value;
+        return true;
+    }
+
+    /** Loads the children of the root; deeper nodes depend on them. */
+    void prefetch(const std::string &) const
+    {
+        if (root_ == NULL || root_->kids == NULL)
+            return;
+        if (!root_->kids->index.empty())
+            prefetch_line(&root_->kids->index[0]);
+    }
+
+    void set(const std::string &key, string_ref value)
+    {
+        node *n = make(key);
+        if (!n->has_value) {
+            n->has_value = true;
+            size_++;
+            sorted_ = false;
+        }
+        n->value.assign(value.data, value.size);
+    }
+
+    bool erase(const std::string &key)
+    {
+        node *n = const_cast<node *>(lookup(key));
+        if (n == NULL || !n->has_value)
+            return false;
+        n->has_value = false;
+        std::string().swap(n->value);
+        size_--;
+        sorted_ = false;
+        // drop the nodes left without values or children
+        while (n != root_ && !n->has_value && n->kids == NULL) {
+            node *parent = n->parent;
+            unlink(parent, n);
+            delete n;
+            n = parent;
+        }
+        return true;
+    }
+
+    size_t size() const { return size_; }
+
+    void clear()
+    {
+        destroy(root_);
+        root_ = NULL;
+        size_ = 0;
+        entries_.clear();
+        sorted_ = true;
+    }
+
+    void commit() {}
+
+    void swap(tree_storage &o)
+    {
+        std::swap(root_, o.root_);
+        std::swap(size_, o.size_);
+        entries_.swap(o.entries_);
+        std::swap(sorted_, o.sorted_);
+    }
+
+    template <class Visitor>
+    void memory(Visitor *v) const
+    {
+        memory_stats shared;
+        std::string path;
+
+        if (root_ != NULL)
+            account(root_, &path, v, &shared);
+        shared.caches = entries_.capacity() * sizeof(entry);
+        for (size_t i = 0; i < entries_.size(); i++)
+            shared.caches += string_overhead(entries_[i].first)
+                             + entries_[i].first.size();
+        shared.overhead += sizeof(*this);
+        v->shared(shared);
+    }
+
+  private:
+    /** Children are indexed by hash beyond this many. */
+    static const size_t scan_limit = 8;
+
+    struct node;
+    /** The children of an inner node; leaves have none. */
+    struct branch {
+        std::vector<node *> nodes;
+        /** Positions in nodes plus one by segment hash, or empty. */
+        std::vector<uint32_t> index;
+    };
+    struct node {
+        std::string segment;
+        std::string value;
+        bool has_value;
+        node *parent;
+        branch *kids;
+    };
+    typedef std::pair<std::string, const node *> entry;
+
+    tree_storage(const tree_storage&);
+    void operator=(const tree_storage&);
+
+    static uint64_t hash(string_ref s)
+    {
+        return wire::mix64(wire::hash_bytes(wire::hash_seed, s.data, s.size));
+    }
+
+    static void destroy(node *n)
+    {
+        if (n == NULL)
+            return;
+        if (n->kids != NULL) {
+            for (size_t i = 0; i < n->kids->nodes.size(); i++)
+                destroy(n->kids->nodes[i]);
+            delete n->kids;
+        }
+        delete n;
+    }
+
+    static node *child(const node *n, string_ref segment)
+    {
+        const branch *b = n->kids;
+
+        if (b == NULL)
+            return NULL;
+        if (b->index.empty()) {
+            for (size_t i = 0; i < b->nodes.size(); i++)
+                if (string_ref(b->nodes[i]->segment) == segment)
+                    return b->nodes[i];
+            return NULL;
+        }
+        size_t mask = b->index.size() - 1;
+        for (size_t i = hash(segment) & mask; b->index[i] != 0;
+             i = (i + 1) & mask) {
+            node *c = b->nodes[b->index[i] - 1];
+            if (string_ref(c->segment) == segment)
+                return c;
+        }
+        return NULL;
+    }
+
+    static node *new_node(node *parent, string_ref segment)
+    {
+        node *n = new node;
+        n->segment.assign(segment.data, segment.size);
+        n->has_value = false;
+        n->parent = parent;
+        n->kids = NULL;
+        return n;
+    }
+
+    /** Rebuilds the hash index of b, or drops it. */
+    static void reindex(branch *b)
+    {
+        size_t cap = 16;
+
+        std::vector<uint32_t>().swap(b->index);
+        if (b->nodes.size() <= scan_limit)
+            return;
+        while (cap < b->nodes.size() * 4)
+            cap *= 2;
+        b->index.assign(cap, 0);
+        for (size_t c = 0; c < b->nodes.size(); c++) {
+            size_t i = hash(b->nodes[c]->segment) & (cap - 1);
+            while (b->index[i] != 0)
+                i = (i + 1) & (cap - 1);
+            b->index[i] = static_cast<uint32_t>(c + 1);
+        }
+    }
+
+    static node *add_child(node *n, string_ref segment)
+    {
+        node *c = new_node(n, segment);
+
+        if (n->kids == NULL)
+            n->kids = new branch;
+        branch *b = n->kids;
+        b->nodes.push_back(c);
+        if (b->nodes.size() <= scan_limit)
+            return c;
+        if (b->nodes.size() * 2 > b->index.size()) {
+            reindex(b);
+            return c;
+        }
+        size_t mask = b->index.size() - 1;
+        size_t i = hash(segment) & mask;
+        while (b->index[i] != 0)
+            i = (i + 1) & mask;
+        b->index[i] = static_cast<uint32_t>(b->nodes.size());
+        return c;
+    }
+
+    static void unlink(node *n, node *c)
+    {
+        branch *b = n->kids;
+
+        b->nodes.erase(std::find(b->nodes.begin(), b->nodes.end(), c));
+        if (b->nodes.empty()) {
+            delete b;
+            n->kids = NULL;
+        } else {
+            reindex(b);
+        }
+    }
+
+    /** Returns the node of key, or NULL. */
+    const node *lookup(string_ref key) const
+    {
+        const node *n = root_;
+        const char *p = key.data, *end = key.data + key.size;
+
+        while (n != NULL) {
+            const char *dot = static_cast<const char *>(
+                    memchr(p, '.', end - p));
+            if (dot == NULL)
+                dot = end;
+            n = child(n, string_ref(p, dot - p));
+            if (dot == end)
+                return n;
+            p = dot + 1;
+        }
+        return NULL;
+    }
+
+    /** Returns the node of key, creating the missing path. */
+    node *make(string_ref key)
+    {
+        const char *p = key.data, *end = key.data + key.size;
+        node *n;
+
+        if (root_ == NULL)
+            root_ = new_node(NULL, string_ref());
+        for (n = root_; ; ) {
+            const char *dot = static_cast<const char *>(
+                    memchr(p, '.', end - p));
+            if (dot == NULL)
+                dot = end;
+            string_ref segment(p, dot - p);
+            node *c = child(n, segment);
+            n = (c != NULL) ? c : add_child(n, segment);
+            if (dot == end)
+                return n;
+            p = dot + 1;
+        }
+    }
+
+    /** Appends the entries below n, whose key is *path. */
+    void collect(const node *n, std::string *path) const
+    {
+        size_t len = path->size();
+
+        if (n->has_value)
+            entries_.push_back(entry(*path, n));
+        if (n->kids == NULL)
+            return;
+        for (size_t i = 0; i < n->kids->nodes.size(); i++) {
+            const node *c = n->kids->nodes[i];
+            if (n != root_)
+                path->append(1, '.');
+            path->append(c->segment);
+            collect(c, path);
+            path->resize(len);
+        }
+    }
+
+    /** Lists the entries in key order after a change. */
+    void sort() const
+    {
+        std::string path;
+
+        if (sorted_)
+            return;
+        entries_.clear();
+        entries_.reserve(size_);
+        if (root_ != NULL)
+            collect(root_, &path);
+        std::sort(entries_.begin(), entries_.end());
+        sorted_ = true;
+    }
+
+    template <class Visitor>
+    void account(const node *n, std::string *path, Visitor *v,
+                 memory_stats *shared) const
+    {
+        size_t len = path->size();
+        memory_stats m;
+
+        m.keys = n->segment.size();
+        m.values = n->value.size();
+        if (n->kids != NULL) {
+            const branch *b = n->kids;
+            m.index += heap_block(sizeof(branch))
+                       + heap_block(b->nodes.capacity() * sizeof(node *));
+            if (b->index.capacity() > 0)
+                m.index += heap_block(b->index.capacity() * sizeof(uint32_t));
+        }
+        // the two strings are inside the node
+        m.overhead = heap_block(sizeof(node)) - 2 * sizeof(std::string)
+                     + string_overhead(n->segment)
+                     + string_overhead(n->value);
+        if (n->has_value) {
+            m.count = 1;
+            v->entry(*path, m);
+        } else {
+            *shared += m;
+        }
+        if (n->kids == NULL)
+            return;
+        for (size_t i = 0; i < n->kids->nodes.size(); i++) {
+            const node *c = n->kids->nodes[i];
+            if (n != root_)
+                path->append(1, '.');
+            path->append(c->segment);
+            account(c, path, v, shared);
+            path->resize(len);
+        }
+    }
+
+    node *root_;
+    /** Keys with a value. */
+    size_t size_;
+    /** Full keys in key order, valid if sorted_. */
+    mutable std::vector<entry> entries_;
+    mutable bool sorted_;
+};
+
+/**
+ * Persistent storage on a hash array mapped trie.
+ *
+ * The trie branches 64 ways on six bits of a 64-bit key hash per level,
+ * each node holding only its used branches behind a bitmap. A copy of
+ * the storage shares every node with the original and costs a
+ * reference count; a write then copies only the nodes on the path to
+ * its key, so keeping many versions of a large setting costs memory in
+ * proportion to what changed between them. Nodes not shared with
+ * another copy are updated in place.
+ *
+ * diff() between two versions skips every subtree they still share.
+ * Iteration sorts the keys once after each change, like hash_storage.
+ */
+class hamt_storage {
+  public:
+    hamt_storage(): root_(NULL), size_(0), sorted_(true) {}
+
+    hamt_storage(const hamt_storage &o)
+        :root_(o.root_), size_(o.size_), sorted_(false)
+    {
+        retain(root_);
+    }
+
+    hamt_storage& operator=(const hamt_storage &o)
+    {
+        retain(o.root_);
+        release(root_);
+        root_ = o.root_;
+        size_ = o.size_;
+        sorted_ = false;
+        order_.clear();
+        return *this;
+    }
+
+    ~hamt_storage() { release(root_); }
+
+    class const_iterator {
+      public:
+        const_iterator(): owner_(NULL), pos_(0) {}
+        const_iterator(const hamt_storage *owner, size_t pos)
+            :owner_(owner), pos_(pos) {}
+
+        string_ref key() const { return owner_->order_[pos_]->key; }
+        string_ref value() const { return owner_->order_[pos_]->value; }
+        const_iterator& operator++() { ++pos_; return *this; }
+        bool operator==(const const_iterator &o) const { return pos_ == o.pos_; }
+        bool operator!=(const const_iterator &o) const { return pos_ != o.pos_; }
+
+      private:
+        const hamt_storage *owner_;
+        size_t pos_;
+    };
+
+    const_iterator begin() const
+    {
+        sort();
+        return const_iterator(this, 0);
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(this, size_);
+    }
+
+    bool find(const std::string &key, string_ref *value) const
+    {
+        const leaf *l = lookup(key, hash(key));
+        if (l == NULL)
+            return false;
+        *value = l->value;
+        return true;
+    }
+
+    /** Loads the branch of the root that key goes down. */
+    void prefetch(const std::string &key) const
+    {
+        if (root_ == NULL || root_->slots.empty())
+            return;
+        uint64_t bit = 1ULL << (hash(key) & 63);
+        size_t pos = popcount(root_->bitmap & (bit - 1));
+        prefetch_line(&root_->slots[std::min(pos, root_->slots.size() - 1)]);
+    }
+
+    void set(const std::string &key, string_ref value)
+    {
+        leaf *l = new leaf;
+        bool added = false;
+
+        l->refs = 1;
+        l->hash = hash(key);
+        l->key = key;
+        l->value.assign(value.data, value.size);
+        if (root_ == NULL)
+            root_ = make_node();
+        root_ = assoc(root_, 0, l, &added);
+        if (added)
+            size_++;
+        sorted_ = false;
+    }
+
+    bool erase(const std::string &key)
+    {
+        uint64_t h = hash(key);
+
+        // check first, removing copies the path
+        if (lookup(key, h) == NULL)
+            return false;
+        root_ = dissoc(root_, 0, key, h);
+        size_--;
+        sorted_ = false;
+        return true;
+    }
+
+    size_t size() const { return size_; }
+
+    void clear()
+    {
+        release(root_);
+        root_ = NULL;
+        size_ = 0;
+        order_.clear();
+        sorted_ = true;
+    }
+
+    void commit() {}
+
+    void swap(hamt_storage &o)
+    {
+        std::swap(root_, o.root_);
+        std::swap(size_, o.size_);
+        order_.swap(o.order_);
+        std::swap(sorted_, o.sorted_);
+    }
+
+    /**
+     * Reports the keys that differ between two versions, skipping the
+     * subtrees they share. Calls v->removed(key) for keys only in a,
+     * v->added(key, value) for keys only in b and v->common(key, va, vb)
+     * for keys in both whose entries are not shared.
+     */
+    template <class Visitor>
+    static void diff(const hamt_storage &a, const hamt_storage &b,
+                     Visitor *v)
+    {
+        diff_nodes(a.root_, b.root_, 0, v);
+    }
+
+    /** Memory shared with other versions is counted in full. */
+    template <class Visitor>
+    void memory(Visitor *v) const
+    {
+        memory_stats shared;
+
+        if (root_ != NULL)
+            node_memory(root_, v, &shared);
+        shared.index += order_.capacity() * sizeof(leaf *);
+        shared.overhead += sizeof(*this);
+        v->shared(shared);
+    }
+
+  private:
+    /** A key-value pair, shared between versions. */
+    struct leaf {
+        size_t refs;
+        uint64_t hash;
+        std::string key;
+        std::string value;
+    };
+
+    struct node;
+
+    /** A branch of a node, either a leaf or a child node. */
+    struct slot {
+        leaf *item;
+        node *child;
+    };
+
+    /**
+     * A trie node. Below the last level of hash bits the node keeps
+     * colliding leaves in a plain list and bitmap is unused.
+     */
+    struct node {
+        size_t refs;
+        uint64_t bitmap;
+        std::vector<slot> slots;    ///< one per bit set, in bit order
+    };
+
+    static const unsigned bits = 6;
+
+    static uint64_t hash(string_ref s)
+    {
+        return wire::mix64(wire::hash_bytes(wire::hash_seed, s.data, s.size));
+    }
+
+    static unsigned popcount(uint64_t x)
+    {
+#ifdef __GNUC__
+        return __builtin_popcountll(x);
+#else
+        unsigned n = 0;
+        for (; x != 0; x &= x - 1)
+            n++;
+        return n;
+#endif
+    }
+
+    static node *make_node()
+    {
+        node *n = new node;
+        n->refs = 1;
+        n->bitmap = 0;
+        return n;
+    }
+
+    static void retain(node *n)
+    {
+        if (n != NULL)
+            __sync_fetch_and_add(&n->refs, 1);
+    }
+
+    static void retain(leaf *l)
+    {
+        __sync_fetch_and_add(&l->refs, 1);
+    }
+
+    static void release(leaf *l)
+    {
+        if (__sync_sub_and_fetch(&l->refs, 1) == 0)
+            delete l;
+    }
+
+    static void release(node *n)
+    {
+        if (n == NULL || __sync_sub_and_fetch(&n->refs, 1) != 0)
+            return;
+        for (size_t i = 0; i < n->slots.size(); i++) {
+            if (n->slots[i].child != NULL)
+                release(n->slots[i].child);
+            else
+                release(n->slots[i].item);
+        }
+        delete n;
+    }
+
+    /**
+     * Makes n writable: returns n itself if this is its only owner,
+     * otherwise a copy sharing its branches, dropping the reference to
+     * n.
+     */
+    static node *own(node *n)
+    {
+        if (n->refs == 1)
+            return n;
+        node *copy = new node(*n);
+        copy->refs = 1;
+        for (size_t i = 0; i < copy->slots.size(); i++) {
+            if (copy->slots[i].child != NULL)
+                retain(copy->slots[i].child);
+            else
+                retain(copy->slots[i].item);
+        }
+        release(n);
+        return copy;
+    }
+
+    const leaf *lookup(string_ref key, uint64_t h) const
+    {
+        const node *n = root_;
+        unsigned shift = 0;
+
+        while (n != NULL) {
+            if (shift >= 64) {
+                for (size_t i = 0; i < n->slots.size(); i++)
+                    if (string_ref(n->slots[i].item->key) == key)
+                        return n->slots[i].item;
+                return NULL;
+            }
+            uint64_t bit = 1ULL << ((h >> shift) & 63);
+            if (!(n->bitmap & bit))
+                return NULL;
+            const slot &s = n->slots[popcount(n->bitmap & (bit - 1))];
+            if (s.child == NULL)
+                return (s.item->hash == h && string_ref(s.item->key) == key)
+                       ? s.item : NULL;
+            n = s.child;
+            shift += bits;
+        }
+        return NULL;
+    }
+
+    /**
+     * Stores l below n, which is at depth shift.
+     *
+     * @return n or its copy; the caller's reference to n is consumed.
+     */
+    static node *assoc(node *n, unsigned shift, leaf *l, bool *added)
+    {
+        slot s = { l, NULL };
+
+        n = own(n);
+        if (shift >= 64) {
+            for (size_t i = 0; i < n->slots.size(); i++) {
+                if (n->slots[i].item->key == l->key) {
+                    release(n->slots[i].item);
+                    n->slots[i].item = l;
+                    return n;
+                }
+            }
+            n->slots.push_back(s);
+            *added = true;
+            return n;
+        }
+
+        uint64_t bit = 1ULL << ((l->hash >> shift) & 63);
+        size_t pos = popcount(n->bitmap & (bit - 1));
+        if (!(n->bitmap & bit)) {
+            n->slots.insert(n->slots.begin() + pos, s);
+            n->bitmap |= bit;
+            *added = true;
+        } else if (n->slots[pos].child != NULL) {
+            n->slots[pos].child = assoc(n->slots[pos].child, shift + bits,
+                                        l, added);
+        } else if (n->slots[pos].item->key == l->key) {
+            release(n->slots[pos].item);
+            n->slots[pos].item = l;
+        } else {
+            // two keys on one branch, push both one level down
+            bool ignore;
+            node *child = assoc(make_node(), shift + bits,
+                                n->slots[pos].item, &ignore);
+            n->slots[pos].item = NULL;
+            n->slots[pos].child = assoc(child, shift + bits, l, added);
+        }
+        return n;
+    }
+
+    /**
+     * Removes key, which must exist, below n at depth shift.
+     *
+     * @return n or its copy, NULL if it became empty; the caller's
+     *         reference to n is consumed.
+     */
+    static node *dissoc(node *n, unsigned shift, string_ref key, uint64_t h)
+    {
+        n = own(n);
+        if (shift >= 64) {
+            size_t pos = 0;
+            while (string_ref(n->slots[pos].item->key) != key)
+                pos++;
+            release(n->slots[pos].item);
+            n->slots.erase(n->slots.begin() + pos);
+        } else {
+            uint64_t bit = 1ULL << ((h >> shift) & 63);
+            size_t pos = popcount(n->bitmap & (bit - 1));
+            slot &s = n->slots[pos];
+            if (s.child != NULL) {
+                s.child = dissoc(s.child, shift + bits, key, h);
+                if (s.child != NULL)
+                    return n;
+            } else {
+                release(s.item);
+            }
+            n->slots.erase(n->slots.begin() + pos);
+            n->bitmap &= ~bit;
+        }
+        if (n->slots.empty()) {
+            release(n);
+            return NULL;
+        }
+        return n;
+    }
+
+    static void collect(const slot *s, std::vector<const leaf *> *out)
+    {
+        if (s == NULL)
+            return;
+        if (s->child == NULL) {
+            out->push_back(s->item);
+            return;
+        }
+        for (size_t i = 0; i < s->child->slots.size(); i++)
+            collect(&s->child->slots[i], out);
+    }
+
+    static bool leaf_less(const leaf *a, const leaf *b)
+    {
+        return a->key < b->key;
+    }
+
+    /** Compares two sets of leaves by key. */
+    template <class Visitor>
+    static void diff_leaves(std::vector<const leaf *> *a,
+                            std::vector<const leaf *> *b, Visitor *v)
+    {
+        size_t i = 0, j = 0;
+
+        std::sort(a->begin(), a->end(), leaf_less);
+        std::sort(b->begin(), b->end(), leaf_less);
+        while (i < a->size() || j < b->size()) {
+            if (j == b->size()
+                || (i < a->size() && (*a)[i]->key < (*b)[j]->key)) {
+                v->removed(string_ref((*a)[i++]->key));
+            } else if (i == a->size() || (*b)[j]->key < (*a)[i]->key) {
+                v->added(string_ref((*b)[j]->key), string_ref((*b)[j]->value));
+                j++;
+            } else {
+                if ((*a)[i] != (*b)[j])
+                    v->common(string_ref((*a)[i]->key),
+                              string_ref((*a)[i]->value),
+                              string_ref((*b)[j]->value));
+                i++;
+                j++;
+            }
+        }
+    }
+
+    template <class Visitor>
+    static void diff_nodes(const node *a, const node *b, unsigned shift,
+                           Visitor *v)
+    {
+        std::vector<const leaf *> la, lb;
+
+        if (a == b)
+            return;
+        if (a == NULL || b == NULL || shift >= 64) {
+            const node *n[2] = { a, b };
+            std::vector<const leaf *> *l[2] = { &la, &lb };
+            for (int k = 0; k < 2; k++)
+                for (size_t i = 0; n[k] != NULL && i < n[k]->slots.size(); i++)
+                    collect(&n[k]->slots[i], l[k]);
+            diff_leaves(&la, &lb, v);
+            return;
+        }
+        for (unsigned idx = 0; idx < 64; idx++) {
+            uint64_t bit = 1ULL << idx;
+            const slot *sa = (a->bitmap & bit)
+                    ? &a->slots[popcount(a->bitmap & (bit - 1))] : NULL;
+            const slot *sb = (b->bitmap & bit)
+                    ? &b->slots[popcount(b->bitmap & (bit - 1))] : NULL;
+            if (sa == NULL && sb == NULL)
+                continue;
+            if (sa != NULL && sb != NULL) {
+                if (sa->child == NULL ? sa->item == sb->item
+                                      : sa->child == sb->child)
+                    continue;
+                if (sa->child != NULL && sb->child != NULL) {
+                    diff_nodes(sa->child, sb->child, shift + bits, v);
+                    continue;
+                }
+            }
+            la.clear();
+            lb.clear();
+            collect(sa, &la);
+            collect(sb, &lb);
+            diff_leaves(&la, &lb, v);
+        }
+    }
+
+    template <class Visitor>
+    static void node_memory(const node *n, Visitor *v, memory_stats *shared)
+    {
+        shared->index += heap_block(sizeof(node))
+                         + heap_block(n->slots.capacity() * sizeof(slot));
+        for (size_t i = 0; i < n->slots.size(); i++) {
+            const slot &s = n->slots[i];
+            if (s.child != NULL) {
+                node_memory(s.child, v, shared);
+                continue;
+            }
+            memory_stats m;
+            m.count = 1;
+            m.keys = s.item->key.size();
+            m.values = s.item->value.size();
+            m.overhead = heap_block(sizeof(leaf)) - 2 * sizeof(std::string)
+                         + string_overhead(s.item->key)
+                         + string_overhead(s.item->value);
+            v->entry(s.item->key, m);
+        }
+    }
+
+    void sort() const
+    {
+        if (sorted_)
+            return;
+        order_.clear();
+        order_.reserve(size_);
+        for (size_t i = 0; root_ != NULL && i < root_->slots.size(); i++)
+            collect(&root_->slots[i], &order_);
+        std::sort(order_.begin(), order_.end(), leaf_less);
+        sorted_ = true;
+    }
+
+    node *root_;
+    size_t size_;
+    /** Leaves in key order, valid if sorted_. */
+    mutable std::vector<const leaf *> order_;
+    mutable bool sorted_;
+};
+
+/**
+ * Copy-on-write layer over another storage, used by every setting.
+ *
+ * Keys live in an owned storage on top of an optional base shared
+ * read-only with other layers. Keys of the base removed from this layer
+ * are remembered separately. share() freezes the content into a base
+ * and hands it out, and later writes on either side land in their own
+ * top layer and cost only what they change.
+ *
+ * A base is a full storage, or a delta of changed and removed keys
+ * over a full storage it shares with other bases. Freezing a layer
+ * written on top of a base costs what the layer changed: the changes
+ * move into the base itself if no other layer holds it, or into a new
+ * delta otherwise, which copies the changes of the old delta too. Once
+ * the changes reach half the size of the full storage, they are merged
+ * into a new one, which copies every key. commit() likewise folds the
+ * layers into one when the top has grown to half the size of the base.
+ *
+ * A layer that never shared anything has no base and costs one pointer
+ * test per lookup.
+ */
+template <class Storage>
+class shared_storage {
+  private:
+    typedef typename Storage::const_iterator storage_iterator;
+
+    /** Iterates keys of a top over those of a base, in key order. */
+    template <class Base>
+    class overlay_iterator {
+      public:
+        overlay_iterator() {}
+        overlay_iterator(storage_iterator top, storage_iterator top_end,
+                         Base base, Base base_end,
+                         const std::set<std::string> &removed)
+            :top_(top), top_end_(top_end), base_(base), base_end_(base_end),
+             removed_(removed.begin()), removed_end_(removed.end())
+        {
+            skip();
+        }
+
+        string_ref key() const { return from_top() ? top_.key() : base_.key(); }
+
+        string_ref value() const
+        {
+            return from_top() ? top_.value() : base_.value();
+        }
+
+        overlay_iterator& operator++()
+        {
+            if (from_top()) {
+                if (base_ != base_end_ && base_.key() == top_.key())
+                    ++base_;
+                ++top_;
+            } else {
+                ++base_;
+            }
+            skip();
+            return *this;
+        }
+
+        bool operator==(const overlay_iterator &o) const
+        {
+            return top_ == o.top_ && base_ == o.base_;
+        }
+
+        bool operator!=(const overlay_iterator &o) const
+        {
+            return !(*this == o);
+        }
+
+      private:
+        bool from_top() const
+        {
+            return base_ == base_end_
+                   || (top_ != top_end_ && !(base_.key() < top_.key()));
+        }
+
+        /**
+         * Steps over removed keys of the base, walking removed_ along
+         * with it since both are in key order.
+         */
+        void skip()
+        {
+            while (removed_ != removed_end_ && !from_top()) {
+                string_ref key = base_.key();
+                while (removed_ != removed_end_ && string_ref(*removed_) < key)
+                    ++removed_;
+                if (removed_ == removed_end_ || string_ref(*removed_) != key)
+                    return;
+                ++base_;
+            }
+        }
+
+        storage_iterator top_;
+        storage_iterator top_end_;
+        Base base_;
+        Base base_end_;
+        /** First removed key not before base_. */
+        std::set<std::string>::const_iterator removed_;
+        std::set<std::string>::const_iterator removed_end_;
+    };
+
+    /** Iterates a base: a delta over its full storage. */
+    typedef overlay_iterator<storage_iterator> base_iterator;
+
+  public:
+    typedef overlay_iterator<base_iterator> const_iterator;
+
+    shared_storage(): base_(NULL), size_(0) {}
+    ~shared_storage() { release(); }
+
+    const_iterator begin() const
+    {
+        return const_iterator(top_.begin(), top_.end(), base_begin(),
+                              base_end(), removed_);
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(top_.end(), top_.end(), base_end(),
+                              base_end(), removed_);
+    }
+
+    bool find(const std::string &key, string_ref *value) const
+    {
+        if (top_.find(key, value))
+            return true;
+        if (base_ == NULL || (!removed_.empty() && removed_.count(key)))
+            return false;
+        return base_->find(key, value);
+    }
+
+    void prefetch(const std::string &key) const
+    {
+        top_.prefetch(key);
+        if (base_ != NULL)
+            base_->data.prefetch(key);
+    }
+
+    void set(const std::string &key, string_ref value)
+    {
+        if (base_ != NULL) {
+            string_ref old;
+            if (!find(key, &old))
+                size_++;
+            removed_.erase(key);
+        }
+        top_.set(key, value);
+    }
+
+    bool erase(const std::string &key)
+    {
+        string_ref old;
+
+        if (base_ == NULL)
+            return top_.erase(key);
+        if (!find(key, &old))
+            return false;
+        top_.erase(key);
+        if (base_->find(key, &old))
+            removed_.insert(key);
+        size_--;
+        return true;
+    }
+
+    size_t size() const
+    {
+        return (base_ == NULL) ? top_.size() : size_;
+    }
+
+    void clear()
+    {
+        release();
+        top_.clear();
+        removed_.clear();
+        size_ = 0;
+    }
+
+    void commit()
+    {
+        if (base_ != NULL
+            && (top_.size() + removed_.size()) * 2 > base_->size)
+            flatten();
+        top_.commit();
+    }
+
+    void swap(shared_storage &o)
+    {
+        std::swap(base_, o.base_);
+        top_.swap(o.top_);
+        removed_.swap(o.removed_);
+        std::swap(size_, o.size_);
+    }
+
+    /**
+     * Makes this layer a copy of other sharing all its keys. The content
+     * of other is frozen into a shared base first if needed, which is
+     * the only step costing more than constant time.
+     */
+    void share(const shared_storage &other)
+    {
+        if (this == &other)
+            return;
+        other.freeze();
+        clear();
+        base_ = other.base_;
+        if (base_ != NULL)
+            __sync_fetch_and_add(&base_->refs, 1);
+        size_ = other.size_;
+    }
+
+    /**
+     * Reports the keys that differ between a and b, see
+     * hamt_storage::diff(). This walks both in key order.
+     */
+    template <class Visitor>
+    static void diff(const shared_storage &a, const shared_storage &b,
+                     Visitor *v)
+    {
+        const_iterator i = a.begin(), j = b.begin();
+
+        while (i != a.end() || j != b.end()) {
+            if (j == b.end() || (i != a.end() && i.key() < j.key())) {
+                v->removed(i.key());
+                ++i;
+            } else if (i == a.end() || j.key() < i.key()) {
+                v->added(j.key(), j.value());
+                ++j;
+            } else {
+                v->common(i.key(), i.value(), j.value());
+                ++i;
+                ++j;
+            }
+        }
+    }
+
+    template <class Visitor>
+    void memory(Visitor *v) const
+    {
+        memory_stats shared;
+
+        top_.memory(v);
+        removed_memory(removed_, &shared);
+        if (base_ != NULL) {
+            // a base shared with other layers is not owned by any
+            bool owned = base_->refs == 1;
+            node_memory(base_, owned, v, &shared);
+            if (base_->parent != NULL)
+                node_memory(base_->parent,
+                            owned && base_->parent->refs == 1, v, &shared);
+        }
+        v->shared(shared);
+    }
+
+  private:
+    /**
+     * A storage shared by several layers, never modified while it is.
+     * A delta has the full storage it changes as parent, which has
+     * none.
+     */
+    struct node {
+        Storage data;
+        /** Keys of parent removed by this delta. */
+        std::set<std::string> removed;
+        node *parent;
+        /** Live keys of data over parent. */
+        size_t size;
+        size_t refs;
+
+        node(): parent(NULL), size(0), refs(1) {}
+
+        bool find(const std::string &key, string_ref *value) const
+        {
+            if (data.find(key, value))
+                return true;
+            if (parent == NULL || (!removed.empty() && removed.count(key)))
+                return false;
+            return parent->data.find(key, value);
+        }
+    };
+
+    /** Reports every memory entry of a shared base as shared. */
+    template <class Visitor>
+    struct shared_visitor {
+        Visitor *v;
+        void entry(string_ref, const memory_stats &m) { v->shared(m); }
+        void shared(const memory_stats &m) { v->shared(m); }
+    };
+
+    template <class Visitor>
+    static void node_memory(const node *n, bool owned, Visitor *v,
+                            memory_stats *shared)
+    {
+        if (owned) {
+            n->data.memory(v);
+        } else {
+            shared_visitor<Visitor> sv = { v };
+            n->data.memory(&sv);
+        }
+        removed_memory(n->removed, shared);
+        shared->overhead += sizeof(*n) - sizeof(n->data);
+    }
+
+    static void removed_memory(const std::set<std::string> &removed,
+                               memory_stats *shared)
+    {
+        std::set<std::string>::const_iterator it;
+        for (it = removed.begin(); it != removed.end(); ++it)
+            shared->index += heap_block(4 * sizeof(void *) + sizeof(*it))
+                             + string_overhead(*it) + it->size();
+    }
+
+    base_iterator base_begin() const
+    {
+        if (base_ == NULL)
+            return base_end();
+        const Storage &parent = (base_->parent != NULL)
+                                ? base_->parent->data : empty_;
+        return base_iterator(base_->data.begin(), base_->data.end(),
+                             parent.begin(), parent.end(), base_->removed);
+    }
+
+    base_iterator base_end() const
+    {
+        if (base_ == NULL)
+            return base_iterator(empty_.end(), empty_.end(), empty_.end(),
+                                 empty_.end(), removed_);
+        const Storage &parent = (base_->parent != NULL)
+                                ? base_->parent->data : empty_;
+        return base_iterator(base_->data.end(), base_->data.end(),
+                             parent.end(), parent.end(), base_->removed);
+    }
+
+    static void unref(node *n)
+    {
+        if (n != NULL && __sync_sub_and_fetch(&n->refs, 1) == 0) {
+            unref(n->parent);
+            delete n;
+        }
+    }
+
+    void release() const
+    {
+        unref(base_);
+        base_ = NULL;
+    }
+
+    /**
+     * Moves the top layer into the base, leaving the top empty. See the
+     * class comment for the cost.
+     */
+    void freeze() const
+    {
+        if (top_.size() == 0 && removed_.empty())
+            return;
+
+        node *fresh = base_;
+        if (base_ == NULL) {
+            fresh = new node;
+            fresh->data.swap(top_);
+            size_ = fresh->data.size();
+        } else if (base_->parent == NULL && base_->refs == 1) {
+            fold(fresh);
+        } else {
+            node *full = (base_->parent != NULL) ? base_->parent : base_;
+            size_t changes = top_.size() + removed_.size();
+            if (base_->parent != NULL)
+                changes += base_->data.size() + base_->removed.size();
+
+            if (changes * 2 > full->data.size()) {
+                fresh = new node;
+                for (const_iterator it = begin(); it != end(); ++it)
+                    fresh->data.set(it.key().str(), it.value());
+                top_.clear();
+                removed_.clear();
+                release();
+            } else if (base_->parent == NULL) {
+                fresh = new node;
+                fresh->data.swap(top_);
+                fresh->removed.swap(removed_);
+                // takes over the reference of this layer
+                fresh->parent = base_;
+            } else if (base_->refs == 1) {
+                fold(fresh);
+            } else {
+                fresh = new node;
+                for (storage_iterator it = base_->data.begin();
+                     it != base_->data.end(); ++it)
+                    fresh->data.set(it.key().str(), it.value());
+                fresh->removed = base_->removed;
+                fresh->parent = base_->parent;
+                __sync_fetch_and_add(&fresh->parent->refs, 1);
+                release();
+                fold(fresh);
+            }
+        }
+        fresh->data.commit();
+        // settle lazily built state, readers of a shared base may be
+        // in other threads and must not write to it
+        fresh->data.begin();
+        fresh->size = size_;
+        base_ = fresh;
+    }
+
+    /** Applies the top layer to n, which no other layer holds. */
+    void fold(node *n) const
+    {
+        std::set<std::string>::const_iterator r;
+        string_ref old;
+
+        for (r = removed_.begin(); r != removed_.end(); ++r) {
+            n->data.erase(*r);
+            if (n->parent != NULL && n->parent->data.find(*r, &old))
+                n->removed.insert(*r);
+        }
+        for (storage_iterator it = top_.begin(); it != top_.end(); ++it) {
+            std::string key = it.key().str();
+            n->data.set(key, it.value());
+            if (n->parent != NULL)
+                n->removed.erase(key);
+        }
+        top_.clear();
+        removed_.clear();
+    }
+
+    /** Folds all keys back into the top layer, dropping the base. */
+    void flatten()
+    {
+        Storage merged;
+        for (const_iterator it = begin(); it != end(); ++it)
+            merged.set(it.key().str(), it.value());
+        top_.swap(merged);
+        removed_.clear();
+        release();
+    }
+
+    // freeze() changes the layout but not the content
+    mutable node *base_;
+    mutable Storage top_;
+    /** Keys of base_ removed from this layer. */
+    mutable std::set<std::string> removed_;
+    /** Live keys, maintained while there is a base. */
+    mutable size_t size_;
+    /** Provides iterators while there is no base or no parent. */
+    Storage empty_;
+
+    shared_storage(const shared_storage&);
+    void operator=(const shared_storage&);
+};
+
+/** hamt_storage is persistent already and shares without layers. */
+template <>
+class shared_storage<hamt_storage> : public hamt_storage {
+  public:
+    shared_storage() {}
+
+    /** Makes this a copy of other in constant time. */
+    void share(const shared_storage &other)
+    {
+        hamt_storage::operator=(other);
+    }
+
+    void swap(shared_storage &o) { hamt_storage::swap(o); }
+
+  private:
+    shared_storage(const shared_storage&);
+    void operator=(const shared_storage&);
+};
+
+/** @} */
+
+END_SETTING_NAMESPACE
+
+#endif  // SETTING_STORAGE_H_
+
+// vim: ts=4 sw=4 et ai cindent
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef SETTING_THREAD_H_
+#define SETTING_THREAD_H_
+
+#include <pthread.h>
+
+#include <stdexcept>
+
+#ifndef BEGIN_SETTING_NAMESPACE
+#define BEGIN_SETTING_NAMESPACE namespace dutil {
+#define END_SETTING_NAMESPACE }
+#endif
+
+BEGIN_SETTING_NAMESPACE
+
+/** @addtogroup setting_api libsetting API
+ *
+ *  @{
+ */
+
+/**
+ * @section ThreadPolicy Thread Policy
+ *
+ * A thread policy decides how calls on one setting are serialized. It
+ * is a member of the setting and provides a nested guard which every
+ * public call constructs from it:
+ *
+ * @code
+ * class guard {
+ *   public:
+ *     explicit guard(Policy &p);    // acquire, released in ~guard()
+ * };
+ * @endcode
+ *
+ * The guard must allow the same thread to enter again, since some calls
+ * are made of others.
+ */
+
+/** No locking, for settings used by one thread at a time. */
+class single_threaded {
+  public:
+    class guard {
+      public:
+        explicit guard(single_threaded &) {}
+    };
+};
+
+/**
+ * One recursive mutex per setting, so that it may be shared between
+ * threads. Pointers returned by get_cstr() still point into storage
+ * shared with the next call, which may come from another thread; copy
+ * the value while no other thread reads the same setting, or use the
+ * typed getters.
+ */
+class multi_threaded {
+  public:
+    multi_threaded()
+    {
+        pthread_mutexattr_t attr;
+
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        if (pthread_mutex_init(&mutex_, &attr) != 0) {
+            pthread_mutexattr_destroy(&attr);
+            throw std::runtime_error("can not create mutex.");
+        }
+        pthread_mutexattr_destroy(&attr);
+    }
+
+    ~multi_threaded()
+    {
+        pthread_mutex_destroy(&mutex_);
+    }
+
+    class guard {
+      public:
+        explicit guard(multi_threaded &m): mutex_(&m.mutex_)
+        {
+            pthread_mutex_lock(mutex_);
+        }
+
+        ~guard()
+        {
+            pthread_mutex_unlock(mutex_);
+        }
+
+      private:
+        pthread_mutex_t *mutex_;
+
+        guard(const guard&);
+        void operator=(const guard&);
+    };
+
+  private:
+    pthread_mutex_t mutex_;
+
+    multi_threaded(const multi_threaded&);
+    void operator=(const multi_threaded&);
+};
+
+/** @} */
+
+END_SETTING_NAMESPACE
+
+#endif  // SETTING_THREAD_H_
+
+// vim: ts=4 sw=4 et ai cindent
@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef SETTING_WIRE_H_
+#define SETTING_WIRE_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <stdexcept>
+
+#ifndef BEGIN_SETTING_NAMESPACE
+#define BEGIN_SETTING_NAMESPACE namespace dutil {
+#define END_SETTING_NAMESPACE }
+#endif
+
+BEGIN_SETTING_NAMESPACE
+
+/** @addtogroup setting_api libsetting API
+ *
+ *  @{
+ */
+
+/**
+ * Binary encoding shared by snapshots and the settingd protocol.
+ *
+ * All integers are little-endian and fixed width. Strings are a u32
+ * length followed by the raw bytes. A protocol frame is a u32 length
+ * followed by that many bytes: one opcode byte and its payload.
+ */
+namespace wire {
+
+/** Largest frame a peer may send us. */
+static const uint32_t max_frame_size = 256 * 1024 * 1024;
+
+/** Protocol opcodes. */
+enum opcode {
+    OP_GET = 1,         ///< C->S: string key
+    OP_VALUE,           ///< S->C: u8 found, string resolved value
+    OP_SNAPSHOT,        ///< C->S: empty
+    OP_SNAPSHOT_DATA,   ///< S->C: u32 version, snapshot bytes
+    OP_SUBSCRIBE,       ///< C->S: empty, no reply
+    OP_NOTIFY,          ///< S->C: u32 version, pushed on reload
+    OP_ERROR,           ///< S->C: string message
+    OP_DELTA,           ///< C->S: u32 version the client has
+    OP_DELTA_DATA,      ///< S->C: u32 version, u8 is_delta, delta or
+                        ///<       snapshot bytes
+};
+
+inline void put_u8(std::string *out, uint8_t v)
+{
+    out->push_back(static_cast<char>(v));
+}
+
+inline void put_u32(std::string *out, uint32_t v)
+{
+    char buf[4];
+    for (int i = 0; i < 4; i++)
+        buf[i] = static_cast<char>((v >> (i * 8)) & 0xff);
+    out->append(buf, 4);
+}
+
+inline void put_u64(std::string *out, uint64_t v)
+{
+    put_u32(out, static_cast<uint32_t>(v));
+    put_u32(out, static_cast<uint32_t>(v >> 32));
+}
+
+inline void put_bytes(std::string *out, const char *data, size_t size)
+{
+    put_u32(out, static_cast<uint32_t>(size));
+    out->append(data, size);
+}
+
+inline void put_string(std::string *out, const std::string &s)
+{
+    put_bytes(out, s.data(), s.size());
+}
+
+/** Magic number opening a delta, "SDLT". */
+static const uint32_t delta_magic = 0x544c4453;
+
+/** Record kinds of a delta. */
+enum delta_kind {
+    DELTA_ADD = 1,      ///< string key, string value
+    DELTA_CHANGE,       ///< string key, string value
+    DELTA_REMOVE,       ///< string key
+};
+
+/** Magic number opening a journal file, "SJNL". */
+static const uint32_t journal_magic = 0x4c4e4a53;
+
+/** FNV-1a offset basis, the initial value of hash_bytes(). */
+static const uint64_t hash_seed = 14695981039346656037ULL;
+
+/**
+ * Continues a 64-bit FNV-1a hash over a byte range.
+ *
+ * @param h     Hash so far, hash_seed to start.
+ * @return The updated hash.
+ */
+inline uint64_t hash_bytes(uint64_t h, const char *data, size_t size)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/** Hashes a string together with its length, so "a"+"bc" != "ab"+"c". */
+inline uint64_t hash_string(uint64_t h, const char *data, size_t size)
+{
+    char len[4];
+    for (int i = 0; i < 4; i++)
+        len[i] = static_cast<char>((size >> (i * 8)) & 0xff);
+    return hash_bytes(hash_bytes(h, len, 4), data, size);
+}
+
+inline uint64_t hash_string(uint64_t h, const std::string &s)
+{
+    return hash_string(h, s.data(), s.size());
+}
+
+/** Finalizes a hash so that all output bits depend on all input bits. */
+inline uint64_t mix64(uint64_t h)
+{
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+/**
+ * Starts a frame in out.
+ *
+ * @return Offset to be passed to end_frame().
+ */
+inline size_t begin_frame(std::string *out, uint8_t op)
+{
+    size_t start = out->size();
+    put_u32(out, 0);
+    put_u8(out, op);
+    return start;
+}
+
+/** Patches the length of a frame started by begin_frame(). */
+inline void end_frame(std::string *out, size_t start)
+{
+    uint32_t len = static_cast<uint32_t>(out->size() - start - 4);
+    for (int i = 0; i < 4; i++)
+        (*out)[start + i] = static_cast<char>((len >> (i * 8)) & 0xff);
+}
+
+/** Sequential decoder over a byte buffer. Throws on truncated input. */
+class reader {
+  public:
+    reader(const char *data, size_t size)
+        :pos_(reinterpret_cast<const unsigned char *>(data)),
+         end_(reinterpret_cast<const unsigned char *>(data) + size) {}
+
+    size_t remaining() const { return end_ - pos_; }
+    bool eof() const { return pos_ == end_; }
+
+    uint8_t get_u8()
+    {
+        need(1);
+        return *pos_++;
+    }
+
+    uint32_t get_u32()
+    {
+        uint32_t v = 0;
+        need(4);
+        for (int i = 0; i < 4; i++)
+            v |= static_cast<uint32_t>(pos_[i]) << (i * 8);
+        pos_ += 4;
+        return v;
+    }
+
+    uint64_t get_u64()
+    {
+        uint64_t lo = get_u32();
+        return lo | (static_cast<uint64_t>(get_u32()) << 32);
+    }
+
+    /**
+     * Reads a length-prefixed string without copying it.
+     *
+     * @param data  Set to the first byte of the string.
+     * @return The length of the string.
+     */
+    size_t get_bytes(const char **data)
+    {
+        uint32_t len = get_u32();
+        need(len);
+        *data = reinterpret_cast<const char *>(pos_);
+        pos_ += len;
+        return len;
+    }
+
+    void get_string(std::string *out)
+    {
+        const char *data;
+        size_t len = get_bytes(&data);
+        out->assign(data, len);
+    }
+
+  private:
+    void need(size_t n) const
+    {
+        if (static_cast<size_t>(end_ - pos_) < n)
+            throw std::runtime_error("truncated binary data.");
+    }
+
+    const unsigned char *pos_;
+    const unsigned char *end_;
+};
+
+/**
+ * Tries to cut one complete frame from the front of buf.
+ *
+ * @param buf    Received bytes.
+ * @param op     Set to the opcode of the frame.
+ * @param body   Set to the payload of the frame.
+ * @return true if a frame was removed from buf.
+ */
+inline bool take_frame(std::string *buf, uint8_t *op, std::string *body)
+{
+    if (buf->size() < 4)
+        return false;
+    uint32_t len = reader(buf->data(), 4).get_u32();
+    if (len == 0 || len > max_frame_size)
+        throw std::runtime_error("bad frame length.");
+    if (buf->size() < 4 + static_cast<size_t>(len))
+        return false;
+    *op = static_cast<uint8_t>((*buf)[4]);
+    body->assign(*buf, 5, len - 1);
+    buf->erase(0, 4 + len);
+    return true;
+}
+
+}  // namespace wire
+
+/** @} */
+
+END_SETTING_NAMESPACE
+
+#endif  // SETTING_WIRE_H_
+
+// vim: ts=4 sw=4 et ai cindent
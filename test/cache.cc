@@ -0,0 +1,71 @@
+#include <stdio.h>
+
+#include <iostream>
+
+#include "setting.h"
+
+static std::string key_of(int i)
+{
+    char buf[16];
+    snprintf(buf, sizeof(buf), "k%03d", i);
+    return buf;
+}
+
+static std::string expected(int i)
+{
+    return key_of(i) + " of " + std::string(64, 'x');
+}
+
+int main()
+{
+    const int n = 100;
+    dutil::setting cfg;
+    bool ok = true;
+
+    cfg << ("base = " + std::string(64, 'x'));
+    for (int i = 0; i < n; i++)
+        cfg << (key_of(i) + " = " + key_of(i) + " of $base");
+    cfg.set_cache_budget(1024);
+
+    // every entry holds more than 64 bytes, so at most 16 fit
+    for (int i = 0; i < n; i++)
+        ok &= cfg.get_cstr(key_of(i)) == expected(i);
+    dutil::cache_stats first = cfg.cache_statistics();
+    std::cout << "first    => " << first.hits << " " << first.misses << " "
+              << (first.evictions >= n - 16) << " "
+              << (first.bytes <= 1024) << std::endl;
+    ok &= first.hits == 0 && first.misses == n && first.evictions >= n - 16
+          && first.bytes > 0 && first.bytes <= 1024;
+
+    // the last key is still cached, the first one was evicted
+    ok &= cfg.get_cstr(key_of(n - 1)) == expected(n - 1);
+    ok &= cfg.get_cstr(key_of(0)) == expected(0);
+    dutil::cache_stats again = cfg.cache_statistics();
+    std::cout << "again    => " << again.hits - first.hits << " "
+              << again.misses - first.misses << std::endl;
+    ok &= again.hits == first.hits + 1 && again.misses == first.misses + 1;
+
+    // k000 is the newest entry, the next to be passed by the hand: a
+    // cache full of new keys would evict it unless it was referenced
+    int slots = n - static_cast<int>(first.evictions);
+    cfg.get_cstr(key_of(0));
+    for (int i = 1; i <= slots; i++)
+        cfg.get_cstr(key_of(i));
+    uint64_t hits = cfg.cache_statistics().hits;
+    ok &= cfg.get_cstr(key_of(0)) == expected(0);
+    std::cout << "second   => " << (cfg.cache_statistics().hits - hits)
+              << std::endl;
+    ok &= cfg.cache_statistics().hits == hits + 1;
+
+    // a changed value is not served from the cache
+    cfg << (key_of(0) + " = changed");
+    ok &= cfg.get_cstr(key_of(0)) == std::string("changed");
+
+    cfg.set_cache_budget(64);
+    std::cout << "shrunk   => " << (cfg.cache_statistics().bytes <= 64)
+              << std::endl;
+    ok &= cfg.cache_statistics().bytes <= 64;
+    return ok ? 0 : 1;
+}
+
+// vim: ts=4 sw=4 et ai cindent
@@ -0,0 +1,100 @@
+#include <stdio.h>
+
+#include <iostream>
+
+#include "setting.h"
+
+/** map_storage counting the keys written into any storage. */
+struct counting_storage : dutil::map_storage {
+    static size_t sets;
+
+    void set(const std::string &key, dutil::string_ref value)
+    {
+        sets++;
+        dutil::map_storage::set(key, value);
+    }
+};
+
+size_t counting_storage::sets = 0;
+
+typedef dutil::basic_setting<counting_storage> counting_setting;
+
+/**
+ * Clones a large setting with an override written before each clone,
+ * keeping some clones alive and dropping others.
+ *
+ * @return The most keys written by one override and clone.
+ */
+static size_t clone_after_write()
+{
+    counting_setting cfg, kept, per_request;
+    size_t most = 0;
+    char line[64];
+
+    for (int i = 0; i < 10000; i++) {
+        snprintf(line, sizeof(line), "key%05d = %d", i, i);
+        cfg << line;
+    }
+    cfg.clone(&kept);
+    for (int i = 0; i < 8; i++) {
+        counting_storage::sets = 0;
+        snprintf(line, sizeof(line), "key%05d = override", i);
+        cfg << line;
+        if (i % 2 == 0) {
+            cfg.clone(&per_request);
+        } else {
+            counting_setting dropped;
+            cfg.clone(&dropped);
+            dropped << "request = 1";
+        }
+        most = std::max(most, counting_storage::sets);
+    }
+    return (per_request.get_cstr("key00006") == std::string("override")
+            && per_request.size() == 10000) ? most : 10000;
+}
+
+int main()
+{
+    dutil::setting base("sample.cfg");
+    dutil::setting variant;
+    uint64_t before = base.fingerprint();
+
+    base.clone(&variant);
+    variant.set_cache_budget(4096);
+    variant << "int = 2" << "extra = $int";
+    variant.get_cstr("extra");
+    variant.erase("string");
+
+    std::cout << "base     => " << base.get_int("int") << " "
+              << base.get_cstr("string") << std::endl;
+    std::cout << "variant  => " << variant.get_int("int") << " "
+              << variant.get_cstr("extra") << " "
+              << (variant.get_cstr("string") == NULL) << std::endl;
+    variant.erase("int");
+    std::cout << "erased   => '" << variant.get_cstr("extra") << "'"
+              << std::endl;
+
+    dutil::setting moved;
+    moved.swap(variant);
+    std::cout << "moved    => " << moved.size() << " " << variant.size()
+              << std::endl;
+#if __cplusplus >= 201103L
+    size_t keys = moved.size();
+    dutil::setting taken(std::move(moved));
+    bool move_ok = taken.size() == keys && moved.size() == 0
+                   && taken.get_cstr("extra") != NULL;
+    moved = std::move(taken);
+    move_ok &= moved.size() == keys && taken.size() == 0;
+#else
+    bool move_ok = true;
+#endif
+
+    size_t writes = clone_after_write();
+    std::cout << "writes   => " << writes << std::endl;
+    return (base.fingerprint() == before && base.get_int("int") == 1
+            && base.get_cstr("string") != NULL
+            && moved.get_cstr("int") == NULL && variant.size() == 0
+            && move_ok && writes < 100) ? 0 : 1;
+}
+
+// vim: ts=4 sw=4 et ai cindent
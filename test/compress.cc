@@ -0,0 +1,41 @@
+#include <iostream>
+
+#include "setting.h"
+
+int main()
+{
+    dutil::setting plain("sample.cfg");
+    dutil::setting gzipped("sample.cfg.gz");
+    std::string dump;
+
+    gzipped.dump(&dump);
+    std::cout << "Dump Compressed Config\n" << dump << std::endl;
+    std::cout << "same     => "
+              << (plain.fingerprint() == gzipped.fingerprint()) << std::endl;
+
+    // kept versions share the compressed values
+    dutil::basic_setting<dutil::hamt_storage> cold;
+    std::string big(200, 'x');
+    char key[32];
+    cold.set_cold_storage(64);
+    for (int i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "key%d = ", i);
+        cold << key + big;
+    }
+    cold.keep_history(4);
+    uint32_t first = cold.version();
+    uint64_t before = cold.fingerprint();
+    cold << "key7 = " + std::string(300, 'y');
+    cold.erase("key8");
+    bool changed = std::string(cold.get_cstr("key7")) == std::string(300, 'y');
+    cold.rollback(first);
+    bool restored = cold.fingerprint() == before
+                    && std::string(cold.get_cstr("key7")) == big
+                    && std::string(cold.get_cstr("key8")) == big;
+    std::cout << "cold     => " << changed << " " << restored << std::endl;
+
+    return (plain.fingerprint() == gzipped.fingerprint() && changed
+            && restored) ? 0 : 1;
+}
+
+// vim: ts=4 sw=4 ai cindent et
@@ -0,0 +1,44 @@
+#include <iostream>
+
+#include "setting.h"
+
+typedef dutil::basic_setting<dutil::hash_storage> hash_setting;
+
+template <class Setting>
+static bool check(const char *name)
+{
+    Setting cfg("sample.cfg");
+    std::vector<std::string> keys, values;
+
+    cfg << "dynamic = $int + $long";
+    keys.push_back("int");
+    keys.push_back("missing");
+    keys.push_back("dynamic");
+    keys.push_back("cite");
+    size_t found = cfg.get_many(keys, &values, "none");
+
+    std::cout << name << found;
+    for (size_t i = 0; i < values.size(); i++)
+        std::cout << " '" << values[i] << "'";
+    std::cout << std::endl;
+    return found == 3 && values.size() == keys.size()
+           && values[0] == "1" && values[1] == "none"
+           && values[2] == "1 + 4294967296"
+           && values[3] == cfg.get_cstr("cite");
+}
+
+int main()
+{
+    bool ok = check<dutil::setting>("map      => ");
+    ok &= check<hash_setting>("hash     => ");
+
+    std::vector<std::string> none;
+    std::vector<std::string> values(2, "stale");
+    dutil::setting cfg("sample.cfg");
+    size_t found = cfg.get_many(none, &values);
+    std::cout << "empty    => " << found << " " << values.size() << std::endl;
+
+    return (ok && found == 0 && values.empty()) ? 0 : 1;
+}
+
+// vim: ts=4 sw=4 et ai cindent
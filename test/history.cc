@@ -0,0 +1,41 @@
+#include <iostream>
+
+#include "setting.h"
+
+typedef dutil::basic_setting<dutil::hamt_storage> versioned_setting;
+
+int main()
+{
+    versioned_setting cfg("sample.cfg");
+    versioned_setting old;
+    std::vector<uint32_t> ids;
+    std::string delta;
+    uint32_t first;
+
+    cfg.keep_history(3);
+    first = cfg.version();
+    cfg << "int = 2";
+    uint32_t second = cfg.version();
+    cfg << "# comments make no version";
+    bool quiet = (cfg.version() == second && cfg.size() == 6);
+    cfg << "int = 3";
+    cfg << "string = bye";
+    cfg.versions(&ids);
+    std::cout << "versions => " << ids.size() << std::endl;
+
+    cfg.checkout(ids[0], &old);
+    versioned_setting::make_delta(old, cfg, &delta);
+    old.apply_delta(delta.data(), delta.size());
+    std::cout << "delta    => " << (old.fingerprint() == cfg.fingerprint())
+              << std::endl;
+
+    bool expired = !cfg.rollback(first);
+    cfg.rollback(ids[0]);
+    std::cout << "rollback => " << expired << " " << cfg.get_int("int") << " "
+              << cfg.get_cstr("string") << std::endl;
+    std::cout << "comment  => " << quiet << std::endl;
+    return (quiet && expired && ids.size() == 3 && cfg.get_int("int") == 2
+            && old.get_int("int") == 3) ? 0 : 1;
+}
+
+// vim: ts=4 sw=4 et ai cindent
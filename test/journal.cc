@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <iostream>
+
+#include "setting.h"
+
+static const char *path = "journal.tmp";
+
+static long file_size()
+{
+    FILE *fp = fopen(path, "rb");
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+int main()
+{
+    char line[64];
+    bool ok = true;
+
+    unlink(path);
+    dutil::setting cfg("sample.cfg");
+    cfg.open_journal(path);
+    cfg << "int = 7";
+    cfg.erase("string");
+    {
+        dutil::setting::transaction tx(&cfg);
+        tx << "pool.min = 4" << "pool.max = 8";
+        tx.commit();
+    }
+    for (int i = 0; i < 1000; i++) {
+        snprintf(line, sizeof(line), "counter = %d", i);
+        cfg << line;
+    }
+
+    {
+        dutil::setting replayed("sample.cfg");
+        replayed.open_journal(path);
+        ok &= replayed.fingerprint() == cfg.fingerprint();
+        std::cout << "replayed => " << replayed.get_int("int") << " "
+                  << replayed.get_int("pool.max") << " "
+                  << replayed.get_int("counter") << " "
+                  << (replayed.get_cstr("string") == NULL) << std::endl;
+    }
+
+    // a failed compaction leaves the journal as it was
+    std::string blocked = std::string(path) + ".compact";
+    bool failed = false;
+    mkdir(blocked.c_str(), 0755);
+    try {
+        cfg.compact_journal();
+    } catch (const std::runtime_error &) {
+        failed = true;
+    }
+    rmdir(blocked.c_str());
+    ok &= failed;
+    std::cout << "failed   => " << failed << std::endl;
+
+    long before = file_size();
+    cfg.compact_journal();
+    cfg << "int = 8";
+    ok &= file_size() < before / 10;
+    std::cout << "compact  => " << (file_size() < before / 10) << std::endl;
+
+    // a torn entry at the end is dropped
+    FILE *fp = fopen(path, "ab");
+    fwrite("\x20\0\0\0torn", 1, 8, fp);
+    fclose(fp);
+    {
+        dutil::setting replayed("sample.cfg");
+        replayed.open_journal(path);
+        ok &= replayed.fingerprint() == cfg.fingerprint();
+        std::cout << "torn     => " << replayed.get_int("int") << std::endl;
+    }
+
+    // rollbacks and applied deltas survive a restart
+    cfg.keep_history(4);
+    cfg << "a = 1";
+    uint32_t first = cfg.version();
+    cfg << "a = 2" << "b = 2";
+    cfg.rollback(first);
+    {
+        dutil::setting next;
+        std::string delta;
+        cfg.clone(&next);
+        next << "c = 3";
+        next.erase("int");
+        dutil::setting::make_delta(cfg, next, &delta);
+        cfg.apply_delta(delta.data(), delta.size());
+    }
+    {
+        dutil::setting replayed("sample.cfg");
+        replayed.open_journal(path);
+        ok &= replayed.fingerprint() == cfg.fingerprint();
+        std::cout << "restart  => " << replayed.get_int("a") << " "
+                  << (replayed.get_cstr("b") == NULL) << " "
+                  << replayed.get_int("c") << " "
+                  << (replayed.get_cstr("int") == NULL) << std::endl;
+    }
+    unlink(path);
+    return ok ? 0 : 1;
+}
+
+// vim: ts=4 sw=4 et ai cindent
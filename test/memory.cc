@@ -0,0 +1,67 @@
+#include <string.h>
+
+#include <iostream>
+
+#include "setting.h"
+
+typedef std::map<std::string, dutil::memory_stats> prefix_map;
+
+/** Adds up the per-prefix entries of by_prefix. */
+static dutil::memory_stats sum(const prefix_map &by_prefix)
+{
+    dutil::memory_stats all;
+    for (prefix_map::const_iterator it = by_prefix.begin();
+         it != by_prefix.end(); ++it)
+        all += it->second;
+    return all;
+}
+
+static void print(const char *name, const dutil::memory_stats &m)
+{
+    std::cout << name << m.count << " " << m.keys << " " << m.values
+              << " " << (m.total() > 0) << std::endl;
+}
+
+int main()
+{
+    dutil::setting cfg("sample.cfg");
+    dutil::setting variant;
+    dutil::memory_stats total, entries, cloned;
+    prefix_map by_prefix, cloned_prefix;
+    size_t key_bytes = 0;
+
+    cfg << "core.alpha = 0.05" << "core.id = HU7321" << "net.port = 80";
+    cfg.memory_usage(&total, &by_prefix);
+    entries = sum(by_prefix);
+    const char *keys[] = { "int", "double", "long", "string", "vector",
+                           "cite", "core.alpha", "core.id", "net.port" };
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+        key_bytes += strlen(keys[i]);
+    print("total    => ", total);
+    print("entries  => ", entries);
+    print("core     => ", by_prefix["core"]);
+
+    bool ok = total.count == cfg.size() && entries.count == cfg.size()
+              && entries.keys == key_bytes && total.keys == key_bytes
+              && entries.values == total.values
+              && entries.total() < total.total()
+              && by_prefix.size() == 8 && by_prefix["core"].count == 2
+              && by_prefix["core"].keys == strlen("core.alpha")
+                                           + strlen("core.id");
+
+    // keys of a base shared with cfg belong to no prefix of the clone
+    cfg.clone(&variant);
+    variant << "core.beta = 1";
+    variant.memory_usage(&cloned, &cloned_prefix);
+    entries = sum(cloned_prefix);
+    print("cloned   => ", cloned);
+    print("own      => ", entries);
+
+    ok &= cloned.count == variant.size() && entries.count == 1
+          && cloned_prefix.size() == 1 && cloned_prefix["core"].count == 1
+          && entries.keys == strlen("core.beta")
+          && cloned.keys == key_bytes + strlen("core.beta");
+    return ok ? 0 : 1;
+}
+
+// vim: ts=4 sw=4 et ai cindent
@@ -0,0 +1,117 @@
+#include <fstream>
+#include <iostream>
+
+#include "setting.h"
+
+struct collector {
+    const char *begin;
+    const char *end;
+    std::string cert;
+    size_t cert_line;
+    bool in_place;
+
+    void item(dutil::string_ref key, dutil::string_ref value, size_t line)
+    {
+        if (key == dutil::string_ref("tls.cert")) {
+            cert = value.str();
+            cert_line = line;
+            in_place = value.data >= begin && value.data < end;
+        }
+    }
+};
+
+int main()
+{
+    const char *file = "multiline.tmp";
+    const char text[] =
+        "query = SELECT id, name \\\n"
+        "        FROM users \\\n"
+        "        WHERE id = $id\n"
+        "id = 7\n"
+        "[tls]\n"
+        "cert = <<END\n"
+        "-----BEGIN CERTIFICATE-----\n"
+        "  MIIBszCCAVmgAwIBAgIU\n"
+        "\n"
+        "-----END CERTIFICATE-----\n"
+        "  END  \n"
+        "empty = <<X\n"
+        "X\n"
+        "crlf = <<EOF\r\n"
+        "a\r\n"
+        "b\r\n"
+        "EOF\r\n"
+        "[]\n"
+        "literal = <<END\n"
+        "ends with \\\n"
+        "END\n"
+        "nested = <<END\n"
+        "EOF\n"
+        "END\n";
+    const std::string cert("-----BEGIN CERTIFICATE-----\n"
+                           "  MIIBszCCAVmgAwIBAgIU\n"
+                           "\n"
+                           "-----END CERTIFICATE-----");
+    std::string dumped;
+
+    {
+        std::ofstream ofs(file);
+        ofs << text;
+    }
+    dutil::setting cfg(file);
+    std::cout << "query    => " << cfg.get_cstr("query") << std::endl;
+    std::cout << "cert     => " << (cfg.get_cstr("tls.cert") == cert)
+              << " " << strlen(cfg.get_cstr("tls.empty")) << " "
+              << (std::string(cfg.get_cstr("tls.crlf")) == "a\nb") << std::endl;
+
+    // the whole text is one chunk, so the body is not copied
+    collector whole = { text, text + sizeof(text), "", 0, false };
+    dutil::scanner s;
+    s.feed(text + 0, sizeof(text) - 1, &whole);
+    s.finish(&whole);
+    // a chunk at a time, the body is copied when its chunk ends
+    collector split = { text, text + sizeof(text), "", 0, false };
+    dutil::scanner t;
+    for (size_t i = 0; i < sizeof(text) - 1; i += 7)
+        t.feed(text + i, std::min<size_t>(7, sizeof(text) - 1 - i), &split);
+    t.finish(&split);
+    std::cout << "spans    => " << whole.in_place << " " << whole.cert_line
+              << " " << split.in_place << " " << (split.cert == cert)
+              << std::endl;
+
+    dutil::projection keys;
+    keys.add("tls.crlf");
+    dutil::setting projected;
+    projected.read_from_file(file, keys);
+    std::cout << "project  => " << projected.size() << std::endl;
+
+    cfg.dump(&dumped);
+    std::cout << "\nDump\n" << dumped;
+    {
+        std::ofstream ofs(file);
+        ofs << dumped;
+    }
+    dutil::setting reread(file);
+    std::cout << "reread   => " << (reread.fingerprint() == cfg.fingerprint())
+              << std::endl;
+
+    bool thrown = false;
+    try {
+        dutil::scanner u;
+        u.feed("a = <<END\nb\n", 12, &whole);
+        u.finish(&whole);
+    } catch (const std::runtime_error &e) {
+        std::cout << "error    => " << e.what() << std::endl;
+        thrown = true;
+    }
+    remove(file);
+
+    return (std::string(cfg.get_cstr("query"))
+                == "SELECT id, name FROM users WHERE id = 7"
+            && cfg.get_cstr("tls.cert") == cert && whole.in_place
+            && whole.cert_line == 6 && !split.in_place && split.cert == cert
+            && projected.size() == 1
+            && reread.fingerprint() == cfg.fingerprint() && thrown) ? 0 : 1;
+}
+
+// vim: ts=4 sw=4 et ai cindent
@@ -0,0 +1,29 @@
+#include <iostream>
+
+#include "setting_numa.h"
+
+typedef dutil::basic_setting<dutil::map_storage, dutil::multi_threaded>
+        shared_setting;
+
+int main()
+{
+    shared_setting cfg("sample.cfg");
+    dutil::numa_replicas<shared_setting> replicas;
+    bool same = true;
+
+    replicas.publish(cfg);
+    std::cout << "local    => " << replicas.local().get_int("int")
+              << std::endl;
+
+    cfg << "int = 2";
+    replicas.publish(cfg);
+    for (size_t i = 0; i < replicas.size(); i++)
+        same = same && replicas.replica(i).fingerprint() == cfg.fingerprint();
+    std::cout << "publish  => " << replicas.local().get_int("int") << " "
+              << same << std::endl;
+
+    return (replicas.size() >= 1 && same
+            && replicas.local().get_int("int") == 2) ? 0 : 1;
+}
+
+// vim: ts=4 sw=4 et ai cindent
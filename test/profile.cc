@@ -0,0 +1,44 @@
+#include <iostream>
+
+#include "setting.h"
+
+int main()
+{
+    dutil::setting cfg("sample.cfg");
+    dutil::setting copy;
+    dutil::access_profile warmup, saved;
+    std::string before, after, snapshot;
+    uint64_t fingerprint = cfg.fingerprint();
+
+    cfg.set_profile(&warmup);
+    for (int i = 0; i < 3; i++)
+        cfg.get_int("int");
+    cfg.get_cstr("cite");
+    cfg.set_profile(NULL);
+    cfg.get_int("long");
+    warmup.save("profile.tmp");
+    saved.load("profile.tmp");
+    remove("profile.tmp");
+    std::cout << "profile  => " << saved.size() << " " << saved.count("int")
+              << " " << saved.count("cite") << std::endl;
+
+    cfg.serialize(&snapshot, saved);
+    dutil::wire::reader in(snapshot.data(), snapshot.size());
+    std::string first;
+    in.get_u32();
+    in.get_string(&first);
+    copy.deserialize(snapshot.data(), snapshot.size());
+    std::cout << "snapshot => " << first << " "
+              << (copy.fingerprint() == fingerprint) << std::endl;
+
+    cfg.dump(&before);
+    cfg.optimize_layout(saved);
+    cfg.dump(&after);
+    std::cout << "layout   => " << (before == after) << " "
+              << (cfg.fingerprint() == fingerprint) << std::endl;
+
+    return (saved.size() == 2 && saved.count("int") == 3 && first == "int"
+            && copy.fingerprint() == fingerprint && before == after) ? 0 : 1;
+}
+
+// vim: ts=4 sw=4 et ai cindent
@@ -0,0 +1,26 @@
+#include <iostream>
+
+#include "setting.h"
+
+int main()
+{
+    dutil::setting full("sample.cfg");
+    dutil::setting part;
+    dutil::projection keys;
+
+    keys.add("cite");
+    keys.add("vec");
+    part.read_from_file("sample.cfg", keys);
+    std::cout << "size     => " << part.size() << std::endl;
+
+    std::string cite = part.get_cstr("cite");
+    std::cout << "cite     => " << cite << std::endl;
+
+    int outside = part.get_int("int", -1);
+    std::cout << "outside  => " << outside << std::endl;
+
+    return (part.size() == 2 && cite == full.get_cstr("cite")
+            && outside == -1) ? 0 : 1;
+}
+
+// vim: ts=4 sw=4 et ai cindent
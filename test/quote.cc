@@ -0,0 +1,71 @@
+#include <fstream>
+#include <iostream>
+
+#include "setting.h"
+
+int main()
+{
+    const char *file = "quote.tmp";
+    std::string dumped;
+
+    {
+        std::ofstream ofs(file);
+        ofs << "name = world   \n"
+               "indent = \"    \"\n"
+               "tabbed = \"a\\tb\\\\c \\\"q\\\"\"\n"
+               "greeting = \"Hello, $name\\n\"\n"
+               "price = 'costs $5 \\n'\n"
+               "escaped = costs \\$5 for $name\n"
+               "quoted = $price!\n"
+               "path = C:\\temp\\sub-$name\n"
+               "missing = [$nothing][$name]\n"
+               "half = \"open\n"
+               "braces = ${name}s and ${x\n"
+               "plain = a\\\\b\n"
+               "mixed = a\\\\b $name\n";
+    }
+    dutil::setting cfg(file);
+    cfg << "line = \" spaced \"";
+    std::cout << "name     => '" << cfg.get_cstr("name") << "'" << std::endl
+              << "indent   => '" << cfg.get_cstr("indent") << "'" << std::endl
+              << "tabbed   => '" << cfg.get_cstr("tabbed") << "'" << std::endl
+              << "greeting => '" << cfg.get_cstr("greeting") << "'" << std::endl
+              << "price    => '" << cfg.get_cstr("price") << "'" << std::endl
+              << "escaped  => '" << cfg.get_cstr("escaped") << "'" << std::endl
+              << "quoted   => '" << cfg.get_cstr("quoted") << "'" << std::endl
+              << "path     => '" << cfg.get_cstr("path") << "'" << std::endl
+              << "missing  => '" << cfg.get_cstr("missing") << "'" << std::endl
+              << "half     => '" << cfg.get_cstr("half") << "'" << std::endl
+              << "braces   => '" << cfg.get_cstr("braces") << "'" << std::endl
+              << "line     => '" << cfg.get_cstr("line") << "'" << std::endl
+              << "plain    => '" << cfg.get_cstr("plain") << "'" << std::endl
+              << "mixed    => '" << cfg.get_cstr("mixed") << "'" << std::endl;
+
+    cfg.dump(&dumped);
+    std::cout << "\nDump\n" << dumped;
+    {
+        std::ofstream ofs(file);
+        ofs << dumped;
+    }
+    dutil::setting reread(file);
+    remove(file);
+    std::cout << "reread   => " << (reread.fingerprint() == cfg.fingerprint())
+              << std::endl;
+
+    return (std::string(cfg.get_cstr("name")) == "world"
+            && std::string(cfg.get_cstr("indent")) == "    "
+            && std::string(cfg.get_cstr("tabbed")) == "a\tb\\c \"q\""
+            && std::string(cfg.get_cstr("greeting")) == "Hello, world\n"
+            && std::string(cfg.get_cstr("price")) == "costs $5 \\n"
+            && std::string(cfg.get_cstr("escaped")) == "costs $5 for world"
+            && std::string(cfg.get_cstr("quoted")) == "costs $5 \\n!"
+            && std::string(cfg.get_cstr("path")) == "C:\\temp\\sub-world"
+            && std::string(cfg.get_cstr("missing")) == "[][world]"
+            && std::string(cfg.get_cstr("half")) == "\"open"
+            && std::string(cfg.get_cstr("line")) == " spaced "
+            && std::string(cfg.get_cstr("plain")) == "a\\b"
+            && std::string(cfg.get_cstr("mixed")) == "a\\b world"
+            && reread.fingerprint() == cfg.fingerprint()) ? 0 : 1;
+}
+
+// vim: ts=4 sw=4 et ai cindent
@@ -0,0 +1,95 @@
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+#include "setting.h"
+
+struct counter {
+    size_t items;
+    size_t last_line;
+    std::string cite;
+
+    void item(dutil::string_ref key, dutil::string_ref value, size_t line)
+    {
+        items++;
+        last_line = line;
+        if (key == dutil::string_ref("cite"))
+            cite = value.str();
+    }
+};
+
+static void write_file(const char *filename, const std::string &data)
+{
+    std::ofstream ofs(filename, std::ios::binary);
+    ofs << data;
+}
+
+/**
+ * Scans sample.cfg compressed with zstd, and a copy cut short. Without
+ * SETTING_HAVE_ZSTD the file must be refused instead.
+ */
+static bool scan_zstd(size_t items)
+{
+    std::ifstream ifs("sample.cfg", std::ios::binary);
+    std::string text((std::istreambuf_iterator<char>(ifs)),
+                     std::istreambuf_iterator<char>());
+    std::string packed, error;
+    counter zstd = { 0, 0, "" };
+
+#ifdef SETTING_HAVE_ZSTD
+    packed.resize(ZSTD_compressBound(text.size()));
+    packed.resize(ZSTD_compress(&packed[0], packed.size(), text.data(),
+                                text.size(), 3));
+#else
+    packed = "\x28\xb5\x2f\xfd" + text;
+#endif
+    write_file("sample.cfg.zst", packed);
+    try {
+        dutil::scan_file("sample.cfg.zst", &zstd);
+    } catch (const std::exception &e) {
+        error = e.what();
+    }
+    std::cout << "zstd     => " << zstd.items << " " << error << std::endl;
+#ifdef SETTING_HAVE_ZSTD
+    bool ok = zstd.items == items && error.empty();
+
+    counter cut = { 0, 0, "" };
+    write_file("sample.cfg.zst", packed.substr(0, packed.size() - 8));
+    try {
+        dutil::scan_file("sample.cfg.zst", &cut);
+        ok = false;
+    } catch (const std::exception &e) {
+        std::cout << "zstd     => " << e.what() << std::endl;
+    }
+#else
+    bool ok = error.find("needs SETTING_HAVE_ZSTD") != std::string::npos;
+    (void)items;
+#endif
+    unlink("sample.cfg.zst");
+    return ok;
+}
+
+int main()
+{
+    dutil::setting cfg("sample.cfg");
+    counter plain = { 0, 0, "" };
+    counter gzipped = { 0, 0, "" };
+    counter buffer = { 0, 0, "" };
+    const char text[] = "# comment\n\na = 1\nb=2";
+
+    dutil::scan_file("sample.cfg", &plain);
+    dutil::scan_file("sample.cfg.gz", &gzipped);
+    dutil::scan_buffer(text, sizeof(text) - 1, &buffer);
+    std::cout << "scan     => " << plain.items << " " << plain.last_line
+              << " " << gzipped.items << " " << buffer.items << " "
+              << buffer.last_line << std::endl;
+    bool zstd = scan_zstd(cfg.size());
+
+    return (plain.items == cfg.size() && gzipped.items == cfg.size()
+            && plain.cite == "int is $int, double is $double, long is "
+                             "$long, string is $string."
+            && buffer.items == 2 && buffer.last_line == 4 && zstd)
+           ? 0 : 1;
+}
+
+// vim: ts=4 sw=4 et ai cindent
@@ -0,0 +1,55 @@
+#include <fstream>
+#include <iostream>
+
+#include "setting.h"
+
+typedef dutil::basic_setting<dutil::tree_storage> tree_setting;
+
+int main()
+{
+    const char *file = "section.tmp";
+    std::string flat, sectioned;
+
+    {
+        std::ofstream ofs(file);
+        ofs << "name = demo\n"
+               "[core]\n"
+               "alpha = 0.05\n"
+               "id = HU7321\n"
+               "[ core.db ]\n"
+               "host = localhost\n"
+               "url = ${core.db.host}/$name\n"
+               "[]\n"
+               "tail = 1\n";
+    }
+    tree_setting cfg(file);
+    std::cout << "keys     => " << cfg.size() << " "
+              << cfg.get_cstr("core.alpha") << " "
+              << cfg.get_cstr("core.db.host") << " "
+              << cfg.get_int("tail") << std::endl;
+    std::cout << "url      => " << cfg.get_cstr("core.db.url") << std::endl;
+    uint64_t fingerprint = cfg.fingerprint();
+
+    cfg.dump(&flat);
+    cfg.dump(&sectioned, true);
+    std::cout << "\nSectioned\n" << sectioned;
+    {
+        std::ofstream ofs(file);
+        ofs << sectioned;
+    }
+    dutil::setting reread(file);
+    remove(file);
+    std::cout << "reread   => " << (reread.fingerprint() == fingerprint)
+              << std::endl;
+
+    cfg.erase("core.db.host");
+    cfg.erase("core.db.url");
+    std::cout << "erased   => " << cfg.size() << " "
+              << (cfg.get_cstr("core.db.host") == NULL) << std::endl;
+
+    return (cfg.size() == 4 && reread.fingerprint() == fingerprint
+            && flat.find("core.db.host = localhost") != std::string::npos)
+           ? 0 : 1;
+}
+
+// vim: ts=4 sw=4 et ai cindent
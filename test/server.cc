@@ -0,0 +1,140 @@
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <fstream>
+#include <iostream>
+
+#include "setting_client.h"
+
+static void write_config(const char *filename, const char *text)
+{
+    std::ofstream ofs(filename);
+    ofs << text;
+}
+
+static int connect_raw(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+    return fd;
+}
+
+/** Sends a lookup, shuts down writing and returns the reply. */
+static std::string lookup_then_close(const char *path, const char *key)
+{
+    std::string req, reply;
+    char buf[4096];
+    ssize_t n;
+    int fd = connect_raw(path);
+
+    size_t start = dutil::wire::begin_frame(&req, dutil::wire::OP_GET);
+    dutil::wire::put_string(&req, key);
+    dutil::wire::end_frame(&req, start);
+    send(fd, req.data(), req.size(), MSG_NOSIGNAL);
+    shutdown(fd, SHUT_WR);
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+        reply.append(buf, n);
+    close(fd);
+
+    uint8_t op;
+    std::string body, value;
+    if (dutil::wire::take_frame(&reply, &op, &body)
+        && op == dutil::wire::OP_VALUE) {
+        dutil::wire::reader r(body.data(), body.size());
+        r.get_u8();
+        r.get_string(&value);
+    }
+    return value;
+}
+
+/** Floods the server with lookups without reading a reply. */
+static bool dropped_when_not_reading(const char *path)
+{
+    std::string req;
+    int fd = connect_raw(path);
+
+    for (int i = 0; i < 4096; i++) {
+        size_t start = dutil::wire::begin_frame(&req, dutil::wire::OP_GET);
+        dutil::wire::put_string(&req, "string");
+        dutil::wire::end_frame(&req, start);
+    }
+    bool dropped = false;
+    for (int i = 0; i < 1024 && !dropped; i++)
+        dropped = send(fd, req.data(), req.size(), MSG_NOSIGNAL) < 0;
+    close(fd);
+    return dropped;
+}
+
+int main()
+{
+    const char *sock = "/tmp/libsetting-test.sock";
+    const char *cfg = "/tmp/libsetting-test.cfg";
+    const char *counter = "/tmp/libsetting-test.gen";
+
+    write_config(cfg, "int = 1\nstring = hello\ncite = int is $int\n");
+    unlink(sock);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl("../tools/settingd", "settingd", "-n", counter, sock, cfg,
+              (char *)NULL);
+        _exit(127);
+    }
+
+    dutil::setting_client *client = NULL;
+    for (int i = 0; i < 100 && client == NULL; i++) {
+        try {
+            client = new dutil::setting_client(sock);
+        } catch (const std::exception &) {
+            usleep(20000);
+        }
+    }
+    if (client == NULL) {
+        std::cout << "can not connect to settingd" << std::endl;
+        kill(pid, SIGTERM);
+        return 1;
+    }
+
+    std::string remote;
+    client->lookup("cite", &remote);
+    std::cout << "version  => " << client->version() << std::endl
+              << "int      => " << client->get_int("int") << std::endl
+              << "string   => " << client->get_cstr("string") << std::endl
+              << "cite     => " << client->get_cstr("cite") << std::endl
+              << "remote   => " << remote << std::endl
+              << "updated  => " << client->poll_updates() << std::endl;
+
+    std::string closing = lookup_then_close(sock, "string");
+    bool slow = dropped_when_not_reading(sock);
+    std::cout << "closing  => " << closing << std::endl
+              << "slow     => " << slow << std::endl;
+
+    client->watch(counter);
+    write_config(cfg, "int = 2\nstring = world\ncite = int is $int\n");
+    kill(pid, SIGHUP);
+    bool updated = false;
+    for (int i = 0; i < 50 && !updated; i++)
+        updated = client->poll_updates(100);
+
+    std::cout << "updated  => " << updated << std::endl
+              << "version  => " << client->version() << std::endl
+              << "int      => " << client->get_int("int") << std::endl
+              << "string   => " << client->get_cstr("string") << std::endl
+              << "cite     => " << client->get_cstr("cite") << std::endl;
+
+    delete client;
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(cfg);
+    unlink(counter);
+    return (updated && closing == "hello" && slow) ? 0 : 1;
+}
+
+// vim: ts=4 sw=4 ai cindent et
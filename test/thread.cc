@@ -0,0 +1,39 @@
+#include <pthread.h>
+
+#include <iostream>
+
+#include "setting.h"
+
+typedef dutil::basic_setting<dutil::hash_storage, dutil::multi_threaded>
+        shared_setting;
+
+static void *reader(void *arg)
+{
+    shared_setting *cfg = static_cast<shared_setting *>(arg);
+    long bad = 0;
+
+    for (int i = 0; i < 100000; i++)
+        if (cfg->get_int("int") != 1 || cfg->get_long("long") != 4294967296L)
+            bad++;
+    return reinterpret_cast<void *>(bad);
+}
+
+int main()
+{
+    shared_setting cfg("sample.cfg");
+    pthread_t threads[4];
+    long bad = 0;
+
+    cfg.set_cache_budget(4096);
+    for (int i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, reader, &cfg);
+    for (int i = 0; i < 4; i++) {
+        void *ret;
+        pthread_join(threads[i], &ret);
+        bad += reinterpret_cast<long>(ret);
+    }
+    std::cout << "bad      => " << bad << std::endl;
+    return bad == 0 ? 0 : 1;
+}
+
+// vim: ts=4 sw=4 et ai cindent
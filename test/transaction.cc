@@ -0,0 +1,94 @@
+#include <stdio.h>
+
+#include <iostream>
+
+#include "setting.h"
+
+/** map_storage counting the keys written into any storage. */
+struct counting_storage : dutil::map_storage {
+    static size_t sets;
+
+    void set(const std::string &key, dutil::string_ref value)
+    {
+        sets++;
+        dutil::map_storage::set(key, value);
+    }
+};
+
+size_t counting_storage::sets = 0;
+
+/**
+ * Runs transactions back to back on a large setting.
+ *
+ * @return The most keys written by one of them.
+ */
+static size_t back_to_back()
+{
+    dutil::basic_setting<counting_storage> cfg;
+    size_t most = 0;
+    char line[64];
+
+    for (int i = 0; i < 10000; i++) {
+        snprintf(line, sizeof(line), "key%05d = %d", i, i);
+        cfg << line;
+    }
+    for (int i = 0; i < 4; i++) {
+        counting_storage::sets = 0;
+        dutil::basic_setting<counting_storage>::transaction tx(&cfg);
+        snprintf(line, sizeof(line), "key%05d = changed", i);
+        tx << line;
+        tx.commit();
+        most = std::max(most, counting_storage::sets);
+    }
+    return most;
+}
+
+struct pool_check {
+    bool operator()(const dutil::setting &cfg) const
+    {
+        return cfg.get_int("pool.min") <= cfg.get_int("pool.max");
+    }
+};
+
+int main()
+{
+    dutil::setting cfg("sample.cfg");
+    bool ok = true;
+
+    cfg << "pool.min = 1" << "pool.max = 2";
+    {
+        dutil::setting::transaction tx(&cfg);
+        tx << "pool.min = 4" << "pool.max = 8";
+        std::cout << "staged   => " << cfg.get_int("pool.max") << " "
+                  << tx.staged().get_int("pool.max") << std::endl;
+        ok &= tx.commit(pool_check());
+    }
+    {
+        dutil::setting::transaction tx(&cfg);
+        tx << "pool.min = 16";
+        ok &= !tx.commit(pool_check());
+    }
+    {
+        dutil::setting::transaction tx(&cfg);
+        tx << "pool.max = 32";
+        cfg << "int = 5";
+        ok &= !tx.commit();
+    }
+    {
+        dutil::setting::transaction tx(&cfg);
+        tx << "no separator";
+        ok &= !tx.commit();
+    }
+    std::cout << "pool     => " << cfg.get_int("pool.min") << " "
+              << cfg.get_int("pool.max") << std::endl;
+
+    // the first transaction moves the keys into a shared base once, the
+    // next ones only write what they change
+    size_t writes = back_to_back();
+    std::cout << "writes   => " << writes << std::endl;
+    ok &= writes < 100;
+    return (ok && cfg.get_int("pool.min") == 4 && cfg.get_int("pool.max") == 8)
+           ? 0 : 1;
+}
+
+// vim: ts=4 sw=4 et ai cindent
@@ -0,0 +1,77 @@
+/*
+ * settingd - serves configuration files to local processes.
+ *
+ * usage: settingd [-n <counter>] <socket> <file>...
+ *
+ * SIGHUP re-reads the files and pushes the new version to subscribed
+ * clients, and to the generation counter file given with -n. SIGINT and
+ * SIGTERM shut the daemon down.
+ */
+
+#include <signal.h>
+
+#include <iostream>
+
+#include "setting_server.h"
+
+static volatile sig_atomic_t reload_requested = 0;
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_signal(int sig)
+{
+    if (sig == SIGHUP)
+        reload_requested = 1;
+    else
+        stop_requested = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *counter = NULL;
+    int first = 1;
+
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        counter = argv[2];
+        first = 3;
+    }
+    if (argc < first + 2) {
+        std::cerr << "usage: " << argv[0]
+                  << " [-n <counter>] <socket> <file>..." << std::endl;
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    try {
+        dutil::setting_server server(argv[first]);
+        for (int i = first + 1; i < argc; i++)
+            server.add_file(argv[i]);
+        server.reload();
+        if (counter != NULL)
+            server.notify_through(counter);
+
+        while (!stop_requested) {
+            server.run_once(500);
+            if (reload_requested) {
+                reload_requested = 0;
+                try {
+                    server.reload();
+                } catch (const std::exception &e) {
+                    std::cerr << "settingd: reload failed: " << e.what()
+                              << std::endl;
+                }
+            }
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "settingd: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai cindent et